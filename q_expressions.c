@@ -1,6 +1,25 @@
+/* clock_gettime() and CLOCK_MONOTONIC are POSIX and madvise() is BSD,
+ * neither is declared under a strict -std=c99 or -std=c11 without these.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include <math.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
 #include "mpc.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
 /* Here we are checking if the operating system in windows
  * and then we are making a fake readline function to serve
  * as readline for windows
@@ -39,6 +58,10 @@ void add_history(char* unused) {}
 
 #include <editline/readline.h>
 #include <histedit.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #endif
 
@@ -48,488 +71,6744 @@ void add_history(char* unused) {}
 // easily enumurate the values which makes the code easier to
 // read.
 
-enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR };
+enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_INT,
+  LVAL_BIG, LVAL_TYPES };
+
+/* Opcodes for the builtin operators. Symbols are resolved to one of these
+ * when they are read, so evaluation never has to look at the name.
+ */
+
+enum { LOP_NONE, LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV, LOP_MOD, LOP_POW, LOP_COUNT };
 
 /* This is our main type with which our program handles expressions 
  * We are declaring a new datatype using typedef.
+ *
+ * Only one of num, inum, err, sym or cell is ever in use for a given type, so
+ * they share storage in an anonymous union. Together with a one byte
+ * type and flags this keeps every node at 16 bytes, so a tree walk
+ * touches a quarter of the cache lines it used to. The reference count
+ * lives in what used to be the padding byte after op.
  */
 
 typedef struct lval 
 {
   // We store types using the enum defined above.
-  int type;
+  unsigned char type;
 
-  // This field is used to store numbers.
-  double num;
-  
-  /* Error and Symbol types have some string data */
-  char* err;
-  char* sym;
-  
-  /* Count and Pointer to a list of "lval*" */
-  // We use lval** as it is a pointer to a list 
-  // of pointers. These cointain expressions.
+  // Ownership bits, see the LVAL_F_* flags below.
+  unsigned char flags;
+
+  // Opcode of a Symbol, one of the LOP_* values above.
+  unsigned char op;
 
+  // Owners besides the first, see lval_ref().
+  unsigned char refs;
+
+  /* Count of "lval*" in cell, only used by Sexpr and Qexpr, and the
+   * number of limbs of a Bignum */
   int count;
-  struct lval** cell;
+
+  union
+  {
+    // This field is used to store numbers.
+    double num;
+
+    // Integers get their own 64 bits, see lval_int().
+    int64_t inum;
+
+    /* Error and Symbol types have some string data */
+    char* err;
+    char* sym;
+
+    // We use lval** as it is a pointer to a list 
+    // of pointers. These cointain expressions.
+    struct lval** cell;
+
+    // A packed Qexpr keeps its numbers here instead, see LVAL_F_PACKED.
+    double* nums;
+
+    // Magnitude of a Bignum, see lval_big().
+    uint32_t* limbs;
+  };
   
 } lval;
 
-// All these are functions which return the type lval*
-// which is a pointer to the struc of type lval.
-// These basically act as contructors.
+/* lval flags. LVAL_F_ARENA marks a value whose memory (and the memory
+ * of its strings and cell array) belongs to the line arena, so it must
+ * never be handed to free().
+ *
+ * LVAL_F_PACKED marks a Qexpr made only of doubles. Rather than pointing
+ * at one lval per element it stores the doubles themselves contiguously
+ * in nums, which takes an eighth of the memory and no pointer chasing.
+ * lval_add() turns it back into the boxed form as soon as anything other
+ * than a number goes in, so code going through lval_add(), lval_pop()
+ * and friends never needs to know which form it has.
+ *
+ * LVAL_F_NEG is the sign of a Bignum.
+ */
 
-/* Construct a pointer to a new Number lval */ 
-lval* lval_num(long x) 
-{
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
-  v->num = x;
-  return v;
-}
+enum { LVAL_F_ARENA = 1, LVAL_F_PACKED = 2, LVAL_F_NEG = 4 };
 
-/* Construct a pointer to a new Error lval */ 
-lval* lval_err(char* m) 
-{
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
-  v->err = malloc(strlen(m) + 1);
-  strcpy(v->err, m);
-  return v;
-}
+/* This is the arena (bump) allocator used by the --arena mode.
+ * Instead of calling malloc for every node, all the lvals made while
+ * reading and evaluating one line are carved out of big blocks one after
+ * the other. Nothing is freed node by node, the REPL loop in main releases
+ * the whole arena in one go once the line has been printed. Each thread
+ * has an arena of its own, arena_reset_all() resets them together.
+ */
 
-/* Construct a pointer to a new Symbol lval */ 
-lval* lval_sym(char* s) 
-{
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
-  return v;
-}
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
 
-/* A pointer to a new empty Sexpr lval */
-lval* lval_sexpr(void) 
+typedef struct arena_block
 {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
-  v->count = 0;
-  v->cell = NULL;
-  return v;
-}
+  struct arena_block* next;
+  size_t size;
+  size_t used;
+  char data[];
+} arena_block;
 
-/* A pointer to a new empty Qexpr lval */
-lval* lval_qexpr(void)
+typedef struct arena
 {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
-  v->count = 0;
-  v->cell = NULL;
-  return v;
-}
+  // The block we are currently bumping into, older blocks hang off next.
+  arena_block* head;
+
+  // Bytes handed out since the last reset.
+  size_t bytes;
+} arena;
+
+// Every thread bumps into its own arena, see par_arenas.
+static int arena_enabled = 0;
+static _Thread_local arena line_arena;
 
-/* This is a resursive function acts as the destructor for our lval type structs.
- * It checks what type of the passed lval is and frees up memory of
- * the strings err and sym if the types are LVAL_ERR and LVAL_SYM.
- * If the type is LVAL_SEXPR then it iterates over all the cells 
- * freeing up the memory and frees up the memo allocated to contain 
- * the pointers. It does the same for lval's of type LVAL_QEXPR.
+/* Hands out n bytes from the arena, starting a new block when the
+ * current one is full. Oversized requests get a block of their own.
  */
 
-void lval_del(lval* v) 
+void* arena_alloc(arena* a, size_t n)
 {
+  n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
 
-  switch (v->type) 
+  if (a->head == NULL || a->head->size - a->head->used < n)
   {
-    /* Do nothing special for number type */
-    case LVAL_NUM: break;
-    
-    /* For Err or Sym free the string data */
-    case LVAL_ERR:
-      free(v->err); break;
-    case LVAL_SYM:
-      free(v->sym); break;
-    
-    /* If Sexpr or Qexpr then delete all elements inside */
-    case LVAL_SEXPR:
-    case LVAL_QEXPR:
-      for (int i = 0; i < v->count; i++) 
-      {
-        lval_del(v->cell[i]);
-      }
-      /* Also free the memory allocated to contain the pointers */
-      free(v->cell);
-    break;
+    size_t size = n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE;
+    arena_block* b = malloc(sizeof(arena_block) + size);
+    b->next = a->head;
+    b->size = size;
+    b->used = 0;
+    a->head = b;
   }
-  
-  /* Finally free the memory allocated for the "lval" struct itself */
-  free(v);
+
+  char* p = a->head->data + a->head->used;
+  a->head->used += n;
+  a->bytes += n;
+  return p;
 }
 
-/* This function extracts the lval type expression at the passed 
- * position and moves the remaining pointers back and returns the 
- * extracted expression, acting like popping a value out of a stack
- * and rearranging the remaining values.
+/* Releases everything allocated since the last reset. The newest block
+ * is kept around so the next line doesn't have to go back to malloc.
  */
 
-lval* lval_pop(lval* v, int i) 
+void arena_reset(arena* a)
 {
-  /* Find the item at "i" */
-  lval* x = v->cell[i];
-  
-  /* Shift the memory following the item at "i" over the top of it */
-  memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
-  
-  /* Decrease the count of items in the list */
-  v->count--;
-  
-  /* Reallocate the memory used */
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  return x;
+  if (a->head == NULL)
+  {
+    return;
+  }
+
+  arena_block* b = a->head->next;
+  while (b != NULL)
+  {
+    arena_block* next = b->next;
+    free(b);
+    b = next;
+  }
+
+  a->head->next = NULL;
+  a->head->used = 0;
+  a->bytes = 0;
 }
 
-/* This is similar to lval_pop but instead of arrangin the remaining
- * expressions it deletes them.
+/* This is the pooled allocator used outside of the arena mode.
+ * Long sessions used to malloc and free an lval for every number, which
+ * fragments the heap over time. Instead freed lvals are kept on a free
+ * list and handed out again by the next constructor. Cell arrays come in
+ * power of two capacities (1, 2, 4 ... 128 pointers) with a free list per
+ * size class, bigger arrays are left to malloc. The pool is thread local,
+ * so no locking is needed.
  */
 
-lval* lval_take(lval* v, int i) 
+#define POOL_CLASSES 8
+#define POOL_MAX_FREE 4096
+
+typedef struct pool_slot
 {
-  lval* x = lval_pop(v, i);
-  lval_del(v);
-  return x;
-}
+  struct pool_slot* next;
+} pool_slot;
 
-// This is a prototype to resolve inter-dependencies.
-void lval_print(lval* v);
+typedef struct pool_list
+{
+  pool_slot* head;
+  size_t count;
+} pool_list;
 
-/* This function loops through all the cells in the passed
- * lval and prints them out with a space if it's the last element
- */
+typedef struct lval_pool
+{
+  pool_list lvals;
+  pool_list cells[POOL_CLASSES];
+
+  // How often a request was served from a free list or had to malloc.
+  size_t hits;
+  size_t misses;
+} lval_pool;
 
-void lval_expr_print(lval* v, char open, char close) 
+static _Thread_local lval_pool pool;
+static int pool_stats_enabled = 0;
+
+/* Pops a slot of the given size off a free list, or mallocs a new one. */
+void* pool_get(pool_list* l, size_t size)
 {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) 
+  if (l->head != NULL)
   {
-    
-    /* Print Value contained within */
-    lval_print(v->cell[i]);
-    
-    /* Don't print trailing space if last element */
-    if (i != (v->count-1)) {
-      putchar(' ');
-    }
+    pool_slot* s = l->head;
+    l->head = s->next;
+    l->count--;
+    pool.hits++;
+    return s;
   }
-  putchar(close);
+  pool.misses++;
+  return malloc(size);
 }
 
-/*This function checks the type of the lval and then 
- * prints the appropriate value
+/* Pushes a slot back onto its free list. Lists don't grow without bound,
+ * once they are full the memory goes back to libc.
  */
 
-void lval_print(lval* v) 
+void pool_put(pool_list* l, void* p)
 {
-  switch (v->type) 
+  if (l->count >= POOL_MAX_FREE)
   {
-    case LVAL_NUM:
-      printf("%f", v->num);
-      break;
-    case LVAL_ERR:
-      printf("Error: %s", v->err);
-      break;
-    case LVAL_SYM:
-      printf("%s", v->sym);
-      break;
-    case LVAL_SEXPR:
-      lval_expr_print(v, '(', ')');
-      break;
-    case LVAL_QEXPR:
-      lval_expr_print(v, '{', '}');
+    free(p);
+    return;
   }
+  pool_slot* s = p;
+  s->next = l->head;
+  l->head = s;
+  l->count++;
 }
 
-/* This is the function which is called to print lval values.*/
-void lval_println(lval* v) 
+/* Gives every free slot of this thread back to libc, for threads that
+ * are about to exit and would otherwise leak their lists.
+ */
+
+void pool_drain(void)
 {
-  lval_print(v);
-  putchar('\n');
+  pool_list* lists[POOL_CLASSES + 1] = { &pool.lvals };
+  for (int c = 0; c < POOL_CLASSES; c++)
+  {
+    lists[c + 1] = &pool.cells[c];
+  }
+  for (int i = 0; i < POOL_CLASSES + 1; i++)
+  {
+    while (lists[i]->head != NULL)
+    {
+      pool_slot* s = lists[i]->head;
+      lists[i]->head = s->next;
+      free(s);
+    }
+    lists[i]->count = 0;
+  }
 }
 
-/* This function is used to evaluate expressions. It takes an pointer 
- * to an lval and a pointer to an string which represents an operator.
- * It chekcs if all the experssions in the cells of the passed lval
- * are numbers. If it finds an error then it deletes the passed lval
- * and then returns a new lval of the type LVAL_ERR by calling the 
- * lval_err() function.
- *
- * It then pops the contents of the first cell and then checks if it has 
- * and argumets and if the operator passed is "-" then performs unary 
- * negation.
- *
- * Then as long as there are elements in the cells remaining, it pops 
- * out the next element and then performs arithematic operations on 
- * the previously popped and the element popped in the while loop.
- *
- * It then deletes the expression passed to it and returns the result
- * of the in the new expression.  
+/* Returns the size class of a cell array holding n pointers. -1 means no
+ * array at all and POOL_CLASSES means too big for the pool.
  */
 
-lval* builtin_op(lval* a, char* op) 
+int pool_cell_class(int n)
 {
-  
-  /* Ensure all arguments are numbers */
-  for (int i = 0; i < a->count; i++) 
+  if (n == 0)
   {
-    if (a->cell[i]->type != LVAL_NUM) 
-    {
-      lval_del(a);
-      return lval_err("Cannot operator on non number!");
-    }
+    return -1;
   }
-  
-  /* Pop the first element */
-  lval* x = lval_pop(a, 0);
-  
-  /* If no arguments and sub then perform unary negation */
-  if ((strcmp(op, "-") == 0) && a->count == 0) 
+  int c = 0;
+  while ((1 << c) < n && c < POOL_CLASSES)
   {
-    x->num = -x->num; 
+    c++;
   }
-  
-  /* While there are still elements remaining */
-  while (a->count > 0) 
+  return c;
+}
+
+/* This is the symbol table. Every symbol name is stored exactly once
+ * in an open addressing hash set and lval_sym() just points at the shared
+ * copy, so two symbols are equal exactly when their sym pointers are.
+ * Interned strings are immutable and live until the program exits,
+ * deleting a symbol never frees its string.
+ */
+
+typedef struct symtab
+{
+  char** slots;
+  size_t size;
+  size_t used;
+} symtab;
+
+static symtab symbols;
+
+/* The builtin operators, filled in by intern_builtins() */
+static char* sym_add;
+static char* sym_sub;
+static char* sym_mul;
+static char* sym_div;
+static char* sym_mod;
+static char* sym_pow;
+
+/* FNV-1a hash of the first n bytes of s */
+size_t intern_hash(char* s, size_t n)
+{
+  size_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < n; i++)
   {
-  
-    /* Pop the next element */
-    lval* y = lval_pop(a, 0);
-    
-    /* Perform operation */
-    if (strcmp(op, "+") == 0) 
-    {
-      x->num += y->num; 
-    }
-    if (strcmp(op, "-") == 0)
-    {
-      x->num -= y->num; 
-    }
-    if (strcmp(op, "*") == 0) 
-    {
-      x->num *= y->num; 
-    }
-    if (strcmp(op, "/") == 0) 
-    {
-      if (y->num == 0) 
-      {
-        lval_del(x); lval_del(y);
-        x = lval_err("Division By Zero.");
-        break;
-      }
-      x->num /= y->num;
-    }
-    if (strcmp(op, "%") == 0)
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/* Doubles the table and rehashes every entry into it. */
+void intern_grow(symtab* t)
+{
+  size_t size = t->size ? t->size * 2 : 64;
+  char** slots = calloc(size, sizeof(char*));
+  for (size_t i = 0; i < t->size; i++)
+  {
+    if (t->slots[i] == NULL)
     {
-      x->num = fmod(x->num, y->num);
+      continue;
     }
-    if (strcmp(op, "^") == 0)
+    size_t j = intern_hash(t->slots[i], strlen(t->slots[i])) & (size - 1);
+    while (slots[j] != NULL)
     {
-      x->num = pow(x->num, y->num);
+      j = (j + 1) & (size - 1);
     }
-    
-    /* Delete element now finished with */
-    lval_del(y);
+    slots[j] = t->slots[i];
   }
-  
-  /* Delete input expression and return result */
-  lval_del(a);
-  return x;
+  free(t->slots);
+  t->slots = slots;
+  t->size = size;
 }
 
-/* This again is a function prototype to resolve interdependencies.*/
-lval* lval_eval(lval* v);
-
-/* This function is called by lval_eval() to evaluate s-expressions. 
- * The two functions recursively call each other, this function first 
- * evaluates the last expression and recursively moves on to the First.
- * Once it gets the last expression in the cell field, it then ckecks if 
- * any of the the expressions are of the type LVAL_ERR and if they are 
- * it calls lval_take() with the value of i at that iteration and returns
- * the value that lval_take() returns. 
- *
- * If no errors are present, it then checks if it's an empty expression, 
- * if so it returns the Expression
- *
- * Then it checks if it's a single expression, and calls lval_take() and
- * returns the value.
- *
- * Lastly it checks if the first element (expression in the first cell) is
- * of the type LVAL_SYM, if it isn't it deletes the popped lval, the passed
- * lval and returns an calls lval_err() with an error message.
- *
- * It calls builtin_op() with the Symbol and the passed expression and 
- * assigns that value to a new lval called result and returns this pointer
- * to the lval result after deleting the temporary lval.
+/* Returns the unique copy of the n byte string at s, adding it to the
+ * table if needed. s doesn't have to be null terminated, so the reader
+ * can intern a symbol straight out of the input buffer.
  */
 
-lval* lval_eval_sexpr(lval* v) 
+char* intern_n(char* s, size_t n)
 {
-  
-  /* Evaluate Children */
-  for (int i = 0; i < v->count; i++) 
+  if (symbols.used * 2 >= symbols.size)
   {
-    v->cell[i] = lval_eval(v->cell[i]);
+    intern_grow(&symbols);
   }
-  
-  /* Error Checking */
-  for (int i = 0; i < v->count; i++) 
+
+  size_t i = intern_hash(s, n) & (symbols.size - 1);
+  while (symbols.slots[i] != NULL)
   {
-    if (v->cell[i]->type == LVAL_ERR) 
+    char* e = symbols.slots[i];
+    // strncmp() stops at the end of e, which may be shorter than n.
+    if (strncmp(e, s, n) == 0 && e[n] == '\0')
     {
-      return lval_take(v, i); 
+      return e;
     }
+    i = (i + 1) & (symbols.size - 1);
   }
-  
-  /* Empty Expression */
-  if (v->count == 0) 
-  {
-    return v; 
-  }
-  
-  /* Single Expression */
-  if (v->count == 1) 
-  {
-    return lval_take(v, 0); 
-  }
-  
-  /* Ensure First Element is Symbol */
-  lval* f = lval_pop(v, 0);
-  if (f->type != LVAL_SYM) 
-  {
-    lval_del(f);
-    lval_del(v);
-    return lval_err("S-expression Does not start with symbol.");
-  }
-  
-  /* Call builtin with operator */
-  lval* result = builtin_op(v, f->sym);
-  lval_del(f);
-  return result;
+
+  char* copy = malloc(n + 1);
+  memcpy(copy, s, n);
+  copy[n] = '\0';
+  symbols.slots[i] = copy;
+  symbols.used++;
+  return copy;
 }
 
-/* This function takes in an lval of type v and checks if the 
- * type is LVAL_SEXPR, if it is it passes it to the function
- * lval_eval_sexpr() and returns the other types as it is.
- */
+/* Returns the unique copy of s, adding it to the table if needed. */
+char* intern(char* s)
+{
+  return intern_n(s, strlen(s));
+}
 
-lval* lval_eval(lval* v) 
+void intern_builtins(void)
 {
-  /* Evaluate Sexpressions */
-  if (v->type == LVAL_SEXPR) 
-  {
-    return lval_eval_sexpr(v); 
-  }
-  /* All other lval types remain the same */
-  return v;
+  sym_add = intern("+");
+  sym_sub = intern("-");
+  sym_mul = intern("*");
+  sym_div = intern("/");
+  sym_mod = intern("%");
+  sym_pow = intern("^");
 }
 
-/* This function is called from lval_read() to convert a number which is
- * of the string datatype into a float. It checks if there was any error 
- * during the conversion, and according to that it checks 
+/* This is the instrumentation layer behind --stats, or ":stats on" in the
+ * REPL. It records how long each phase of a line took, parsing, reading,
+ * evaluating, printing and deleting, in a histogram of power of two
+ * nanosecond buckets, and counts the nodes allocated and freed of each
+ * LVAL_* type. Every hook is a single test of stats_enabled when it is
+ * off. The counters are atomic so worker threads can add to them, and
+ * the totals are dumped to stderr at exit or with ":stats".
+ *
+ * mpc_parse() is the parse phase. The native reader parses and builds the
+ * lvals in one go, so it all counts as read. Arena values are counted
+ * freed when their line is reset.
  */
 
-lval* lval_read_num(mpc_ast_t* t) 
+enum { STAT_PARSE, STAT_READ, STAT_EVAL, STAT_PRINT, STAT_DEL, STAT_AST_DELETE,
+  STAT_PHASES };
+
+#define STAT_BUCKETS 48
+
+typedef struct stat_phase
 {
-  errno = 0;
-  double x = atof(t->contents);
-  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
-}
+  atomic_long count;
+  atomic_long total;
+  atomic_long max;
+  // buckets[k] counts durations in [2^k, 2^(k+1)) nanoseconds.
+  atomic_long buckets[STAT_BUCKETS];
+} stat_phase;
 
+typedef struct lval_stats
+{
+  stat_phase phases[STAT_PHASES];
+  atomic_long allocated[LVAL_TYPES];
+  atomic_long freed[LVAL_TYPES];
+  // Allocated from an arena since the last reset.
+  atomic_long arena[LVAL_TYPES];
+} lval_stats;
 
-/* this function adds one more additional cell, or in other words it
- * adds another pointer to the list of pointers and stores the Pointer
+static int stats_enabled = 0;
+static lval_stats stats;
+
+static char* stats_phase_names[] =
+  { "parse", "read", "eval", "print", "delete", "ast_delete" };
+static char* stats_type_names[] =
+  { "err", "num", "sym", "sexpr", "qexpr", "int", "big" };
+
+uint64_t stats_now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* Start of a phase, 0 when neither stats nor perf counters are on */
+// Set by perf_open(), see the --perf section below.
+static int perf_enabled = 0;
+void perf_begin(void);
+void perf_end(int phase);
+
+uint64_t stats_start(void)
+{
+  if (!(stats_enabled | perf_enabled))
+  {
+    return 0;
+  }
+  if (perf_enabled)
+  {
+    perf_begin();
+  }
+  return stats_now();
+}
+
+/* Records the phase that began at start */
+void stats_phase(int phase, uint64_t start)
+{
+  if (start == 0)
+  {
+    return;
+  }
+  if (perf_enabled)
+  {
+    perf_end(phase);
+  }
+  if (!stats_enabled)
+  {
+    return;
+  }
+  long ns = (long)(stats_now() - start);
+  stat_phase* p = &stats.phases[phase];
+  atomic_fetch_add_explicit(&p->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&p->total, ns, memory_order_relaxed);
+
+  long max = atomic_load_explicit(&p->max, memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak(&p->max, &max, ns))
+  {
+  }
+
+  int k = 0;
+  while (k < STAT_BUCKETS - 1 && (2L << k) <= ns)
+  {
+    k++;
+  }
+  atomic_fetch_add_explicit(&p->buckets[k], 1, memory_order_relaxed);
+}
+
+void stats_alloc(int type, int arena)
+{
+  atomic_fetch_add_explicit(&stats.allocated[type], 1, memory_order_relaxed);
+  if (arena)
+  {
+    atomic_fetch_add_explicit(&stats.arena[type], 1, memory_order_relaxed);
+  }
+}
+
+void stats_free(int type)
+{
+  atomic_fetch_add_explicit(&stats.freed[type], 1, memory_order_relaxed);
+}
+
+/* A node changed type in place, from arena nodes the arena count moves
+ * too so the reset frees it as its new type.
+ */
+void stats_retype(int from, int to, int arena)
+{
+  stats_free(from);
+  stats_alloc(to, arena);
+  if (arena)
+  {
+    atomic_fetch_sub_explicit(&stats.arena[from], 1, memory_order_relaxed);
+  }
+}
+
+/* Everything allocated from the arenas has just been released */
+void stats_arena_reset(void)
+{
+  for (int t = 0; t < LVAL_TYPES; t++)
+  {
+    long n = atomic_exchange(&stats.arena[t], 0);
+    atomic_fetch_add(&stats.freed[t], n);
+  }
+}
+
+/* Upper bound of the bucket the q quantile of p falls in */
+long stats_quantile(stat_phase* p, long count, double q)
+{
+  long rank = (long)ceil(q * count);
+  long seen = 0;
+  int k = 0;
+  for (; k < STAT_BUCKETS - 1; k++)
+  {
+    seen += atomic_load(&p->buckets[k]);
+    if (seen >= rank)
+    {
+      break;
+    }
+  }
+  long max = atomic_load(&p->max);
+  return (2L << k) < max ? (2L << k) : max;
+}
+
+void stats_dump(FILE* f)
+{
+  fprintf(f, "%-10s %10s %12s %10s %10s %10s %10s %10s\n", "phase", "count",
+    "total_ms", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+  for (int i = 0; i < STAT_PHASES; i++)
+  {
+    stat_phase* p = &stats.phases[i];
+    long count = atomic_load(&p->count);
+    if (count == 0)
+    {
+      continue;
+    }
+    long total = atomic_load(&p->total);
+    fprintf(f, "%-10s %10ld %12.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+      stats_phase_names[i], count, total / 1e6, total / 1e3 / count,
+      stats_quantile(p, count, 0.5) / 1e3, stats_quantile(p, count, 0.9) / 1e3,
+      stats_quantile(p, count, 0.99) / 1e3, atomic_load(&p->max) / 1e3);
+  }
+
+  /* Histograms, one bar per non empty bucket */
+  for (int i = 0; i < STAT_PHASES; i++)
+  {
+    stat_phase* p = &stats.phases[i];
+    long count = atomic_load(&p->count);
+    if (count == 0)
+    {
+      continue;
+    }
+    fprintf(f, "%s histogram:\n", stats_phase_names[i]);
+    for (int k = 0; k < STAT_BUCKETS; k++)
+    {
+      long n = atomic_load(&p->buckets[k]);
+      if (n == 0)
+      {
+        continue;
+      }
+      int bar = (int)((n * 40 + count - 1) / count);
+      fprintf(f, "  < %12.3f us %10ld %.*s\n", (2L << k) / 1e3, n, bar,
+        "########################################");
+    }
+  }
+
+  fprintf(f, "%-10s %12s %12s %12s\n", "type", "allocated", "freed", "live");
+  for (int t = 0; t < LVAL_TYPES; t++)
+  {
+    long allocated = atomic_load(&stats.allocated[t]);
+    long freed = atomic_load(&stats.freed[t]);
+    fprintf(f, "%-10s %12ld %12ld %12ld\n", stats_type_names[t],
+      allocated, freed, allocated - freed);
+  }
+}
+
+void stats_dump_exit(void)
+{
+  fflush(stdout);
+  stats_dump(stderr);
+}
+
+/* Switches stats on, the totals are dumped when the program exits */
+void stats_enable(void)
+{
+  static int registered = 0;
+  if (!registered)
+  {
+    atexit(stats_dump_exit);
+    registered = 1;
+  }
+  stats_enabled = 1;
+}
+
+/* Clears every counter. Only the REPL calls this, between lines, when
+ * every --parallel task has finished and the workers are idle, so no
+ * other thread is adding to the counters while they are cleared.
+ */
+
+void stats_reset(void)
+{
+  for (int i = 0; i < STAT_PHASES; i++)
+  {
+    stat_phase* p = &stats.phases[i];
+    atomic_store(&p->count, 0);
+    atomic_store(&p->total, 0);
+    atomic_store(&p->max, 0);
+    for (int k = 0; k < STAT_BUCKETS; k++)
+    {
+      atomic_store(&p->buckets[k], 0);
+    }
+  }
+  for (int t = 0; t < LVAL_TYPES; t++)
+  {
+    atomic_store(&stats.allocated[t], 0);
+    atomic_store(&stats.freed[t], 0);
+    atomic_store(&stats.arena[t], 0);
+  }
+}
+
+/* The REPL's ":stats" command, with on, off, reset or nothing to dump.
+ * reset clears the counters and leaves stats on or off as they were.
+ */
+void stats_command(char* arg)
+{
+  while (*arg == ' ')
+  {
+    arg++;
+  }
+  if (strcmp(arg, "on") == 0)
+  {
+    stats_enable();
+  }
+  else if (strcmp(arg, "off") == 0)
+  {
+    stats_enabled = 0;
+  }
+  else if (strcmp(arg, "reset") == 0)
+  {
+    stats_reset();
+  }
+  else
+  {
+    stats_dump(stdout);
+  }
+}
+
+/* Hardware counters per phase, used with --perf FILE.
+ * The phase hooks above also read cycles, instructions, L1 data cache
+ * read misses, last level cache misses and branch misses through
+ * perf_event_open(), and the differences are added up per input line.
+ * At the end of every line one CSV row per phase goes to FILE. Counters
+ * the machine or kernel doesn't allow are left empty, and when none can
+ * be opened at all --perf says so once and is ignored.
+ *
+ * The counters follow the thread that opened them, the main thread, so
+ * work done by --jobs or --parallel workers isn't included. Under --jobs
+ * the main thread only reads, so each form's row just has the read phase.
+ */
+
+#define PERF_COUNTERS 5
+
+static int perf_fds[PERF_COUNTERS] = { -1, -1, -1, -1, -1 };
+static FILE* perf_out;
+static long perf_line = 0;
+static _Thread_local int perf_thread = 0;
+
+// Counter values when the current phase began, and the totals per phase
+// of the current line.
+static uint64_t perf_begin_values[PERF_COUNTERS];
+static uint64_t perf_totals[STAT_PHASES][PERF_COUNTERS];
+static int perf_seen[STAT_PHASES];
+
+/* Reads every counter, unavailable ones read as 0 */
+void perf_read(uint64_t* values)
+{
+#ifdef __linux__
+  for (int i = 0; i < PERF_COUNTERS; i++)
+  {
+    values[i] = 0;
+    if (perf_fds[i] >= 0 && read(perf_fds[i], &values[i], sizeof(uint64_t))
+      != sizeof(uint64_t))
+    {
+      values[i] = 0;
+    }
+  }
+#else
+  memset(values, 0, sizeof(uint64_t) * PERF_COUNTERS);
+#endif
+}
+
+#ifdef __linux__
+int perf_open_counter(uint32_t type, uint64_t config)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/* Opens the counters and the CSV file, 0 if neither worked out */
+int perf_open(char* path)
+{
+  int opened = 0;
+#ifdef __linux__
+  uint64_t l1d = PERF_COUNT_HW_CACHE_L1D
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  perf_fds[0] = perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  perf_fds[1] = perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  perf_fds[2] = perf_open_counter(PERF_TYPE_HW_CACHE, l1d);
+  perf_fds[3] = perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  perf_fds[4] = perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+  for (int i = 0; i < PERF_COUNTERS; i++)
+  {
+    opened += perf_fds[i] >= 0;
+  }
+#endif
+  if (opened == 0)
+  {
+    fprintf(stderr, "lispy: perf events are not available here, "
+      "--perf is ignored\n");
+    return 0;
+  }
+
+  perf_out = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+  if (perf_out == NULL)
+  {
+    fprintf(stderr, "lispy: cannot write %s, --perf is ignored\n", path);
+    return 0;
+  }
+  fprintf(perf_out, "line,phase,cycles,instructions,l1d_misses,llc_misses,"
+    "branch_misses\n");
+  perf_thread = 1;
+  perf_enabled = 1;
+  return 1;
+}
+
+void perf_begin(void)
+{
+  if (perf_thread)
+  {
+    perf_read(perf_begin_values);
+  }
+}
+
+void perf_end(int phase)
+{
+  if (!perf_thread)
+  {
+    return;
+  }
+  uint64_t values[PERF_COUNTERS];
+  perf_read(values);
+  for (int i = 0; i < PERF_COUNTERS; i++)
+  {
+    perf_totals[phase][i] += values[i] - perf_begin_values[i];
+  }
+  perf_seen[phase] = 1;
+}
+
+/* Writes the rows of the line that just finished and starts a new one */
+void perf_line_end(void)
+{
+  if (!perf_enabled)
+  {
+    return;
+  }
+  perf_line++;
+  for (int p = 0; p < STAT_PHASES; p++)
+  {
+    if (!perf_seen[p])
+    {
+      continue;
+    }
+    fprintf(perf_out, "%ld,%s", perf_line, stats_phase_names[p]);
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+      if (perf_fds[i] >= 0)
+      {
+        fprintf(perf_out, ",%llu", (unsigned long long)perf_totals[p][i]);
+      }
+      else
+      {
+        fprintf(perf_out, ",");
+      }
+      perf_totals[p][i] = 0;
+    }
+    fprintf(perf_out, "\n");
+    perf_seen[p] = 0;
+  }
+}
+
+/* Every constructor gets its memory through these two helpers so that
+ * switching to the arena is a single flag. lval_alloc() also stamps the
+ * type and the ownership flag on the new value.
+ */
+
+lval* lval_alloc(int type)
+{
+  if (stats_enabled)
+  {
+    stats_alloc(type, arena_enabled);
+  }
+  lval* v;
+  if (arena_enabled)
+  {
+    v = arena_alloc(&line_arena, sizeof(lval));
+    v->flags = LVAL_F_ARENA;
+  }
+  else
+  {
+    v = pool_get(&pool.lvals, sizeof(lval));
+    v->flags = 0;
+  }
+  v->type = type;
+  v->refs = 0;
+  return v;
+}
+
+/* Copies a string into memory owned by the same allocator as v. */
+char* lval_strdup(lval* v, char* s)
+{
+  size_t n = strlen(s) + 1;
+  char* d = (v->flags & LVAL_F_ARENA) ? arena_alloc(&line_arena, n) : malloc(n);
+  memcpy(d, s, n);
+  return d;
+}
+
+/* Cell arrays carry their capacity in a header word just in front of
+ * the first pointer. That keeps lval itself at 16 bytes while letting
+ * lval_add grow the array geometrically instead of one slot at a time.
+ */
+
+typedef struct cell_block
+{
+  size_t cap;
+  struct lval* cell[];
+} cell_block;
+
+#define CELL_BLOCK(c) ((cell_block*)((char*)(c) - offsetof(cell_block, cell)))
+
+/* Returns how many pointers fit in the cell array of v */
+int lval_cap(lval* v)
+{
+  return v->cell == NULL ? 0 : (int)CELL_BLOCK(v->cell)->cap;
+}
+
+/* Allocates a cell array for at least n pointers from the same allocator
+ * as v. Pooled arrays are rounded up to their size class.
+ */
+
+lval** lval_cells_alloc(lval* v, int n)
+{
+  cell_block* b;
+  if (v->flags & LVAL_F_ARENA)
+  {
+    b = arena_alloc(&line_arena, sizeof(cell_block) + sizeof(lval*) * n);
+    b->cap = n;
+    return b->cell;
+  }
+
+  int c = pool_cell_class(n);
+  if (c < POOL_CLASSES)
+  {
+    b = pool_get(&pool.cells[c], sizeof(cell_block) + (sizeof(lval*) << c));
+    b->cap = (size_t)1 << c;
+    return b->cell;
+  }
+
+  b = malloc(sizeof(cell_block) + sizeof(lval*) * n);
+  b->cap = n;
+  return b->cell;
+}
+
+/* Gives a cell array back to wherever lval_cells_alloc() got it from */
+void lval_cells_free(lval* v, lval** cell)
+{
+  if (cell == NULL || (v->flags & LVAL_F_ARENA))
+  {
+    return;
+  }
+
+  cell_block* b = CELL_BLOCK(cell);
+  int c = pool_cell_class(b->cap);
+  if (c < POOL_CLASSES)
+  {
+    pool_put(&pool.cells[c], b);
+    return;
+  }
+  free(b);
+}
+
+/* Moves the children of v into a cell array with room for n pointers */
+void lval_recap(lval* v, int n)
+{
+  lval** cell = n > 0 ? lval_cells_alloc(v, n) : NULL;
+  if (v->count > 0)
+  {
+    memcpy(cell, v->cell, sizeof(lval*) * v->count);
+  }
+  lval_cells_free(v, v->cell);
+  v->cell = cell;
+}
+
+/* Makes sure v can hold n children without growing again. lval_read
+ * uses this to size a list from the number of children in the AST.
+ */
+
+void lval_reserve(lval* v, int n)
+{
+  if (n > lval_cap(v))
+  {
+    lval_recap(v, n);
+  }
+}
+
+// All these are functions which return the type lval*
+// which is a pointer to the struc of type lval.
+// These basically act as contructors.
+
+/* Construct a pointer to a new Number lval */ 
+lval* lval_num(double x) 
+{
+  lval* v = lval_alloc(LVAL_NUM);
+  v->num = x;
+  return v;
+}
+
+/* Construct a pointer to a new Integer lval. Integers are kept apart
+ * from doubles so that they are exact over the whole 64 bit range, and
+ * only turn into doubles when mixed with one.
+ */
+lval* lval_int(int64_t x)
+{
+  lval* v = lval_alloc(LVAL_INT);
+  v->inum = x;
+  return v;
+}
+
+/* These are the Bignums. An Integer that doesn't fit in 64 bits any more
+ * becomes an LVAL_BIG, which holds a sign (LVAL_F_NEG) and a magnitude
+ * in count limbs, least significant first. Every limb holds 9 decimal
+ * digits, the base is 10^9 rather than 2^32. Multiplying costs the same
+ * either way, but with a decimal base printing and reading are linear,
+ * every limb is exactly 9 digits of the output. With a binary base
+ * getting back to decimal takes a division per 9 digits printed, which
+ * is quadratic unless division is made subquadratic as well.
+ *
+ * An LVAL_BIG only ever holds values outside the int64_t range, anything
+ * smaller goes back to being an LVAL_INT, so every value has one form.
+ *
+ * The arithmetic works on bigints, which are plain C values rather than
+ * lvals so the intermediate results of a reduction never touch the pool.
+ */
+
+#define BIG_BASE 1000000000u
+#define BIG_DIGITS 9
+
+/* Nothing bigger than this many limbs is made, about 150 million digits */
+#define BIG_MAX_LIMBS (1 << 24)
+
+/* Below this many limbs in the smaller operand multiplication is done
+ * the schoolbook way, above it with Karatsuba. Anywhere from 16 to 24
+ * came out best on x86-64, see the threshold line of --bench.
+ */
+static int big_karatsuba_min = 20;
+
+typedef struct bigint
+{
+  // Limbs, least significant first, with no zero limbs on top.
+  uint32_t* d;
+  int n;
+  int neg;
+
+  // Where d points when the bigint is a view of an Integer.
+  uint32_t small[3];
+} bigint;
+
+uint32_t* big_new(int n)
+{
+  return malloc(sizeof(uint32_t) * (n > 0 ? n : 1));
+}
+
+void big_free(bigint* b)
+{
+  if (b->d != b->small)
+  {
+    free(b->d);
+  }
+  b->d = b->small;
+  b->n = 0;
+}
+
+int big_trim(uint32_t* d, int n)
+{
+  while (n > 0 && d[n-1] == 0)
+  {
+    n--;
+  }
+  return n;
+}
+
+/* Replaces the value of b with the n limbs in d, which b takes over */
+void big_set(bigint* b, uint32_t* d, int n, int neg)
+{
+  big_free(b);
+  b->d = d;
+  b->n = big_trim(d, n);
+  b->neg = b->n > 0 ? neg : 0;
+}
+
+void big_copy(bigint* b, bigint* x)
+{
+  b->d = big_new(x->n);
+  memcpy(b->d, x->d, sizeof(uint32_t) * x->n);
+  b->n = x->n;
+  b->neg = x->neg;
+}
+
+/* Makes b a view of x, it needs no freeing */
+void big_from_int(bigint* b, int64_t x)
+{
+  uint64_t u = x < 0 ? -(uint64_t)x : (uint64_t)x;
+  b->d = b->small;
+  b->n = 0;
+  b->neg = x < 0;
+  while (u > 0)
+  {
+    b->small[b->n++] = u % BIG_BASE;
+    u /= BIG_BASE;
+  }
+}
+
+/* Returns 1 and sets *x if b fits in an int64_t */
+int big_to_int(bigint* b, int64_t* x)
+{
+  if (b->n > 3)
+  {
+    return 0;
+  }
+  uint64_t u = 0;
+  for (int i = b->n - 1; i >= 0; i--)
+  {
+    if (u > (UINT64_MAX - b->d[i]) / BIG_BASE)
+    {
+      return 0;
+    }
+    u = u * BIG_BASE + b->d[i];
+  }
+  if (u > (uint64_t)INT64_MAX + b->neg)
+  {
+    return 0;
+  }
+  *x = b->neg ? (int64_t)(0 - u) : (int64_t)u;
+  return 1;
+}
+
+/* The nearest double to b, strtod does the rounding */
+double big_to_double(bigint* b)
+{
+  if (b->n == 0)
+  {
+    return 0;
+  }
+  char* s = malloc((size_t)b->n * BIG_DIGITS + 2);
+  char* p = s;
+  if (b->neg)
+  {
+    *p++ = '-';
+  }
+  p += sprintf(p, "%u", b->d[b->n-1]);
+  for (int i = b->n - 2; i >= 0; i--)
+  {
+    p += sprintf(p, "%09u", b->d[i]);
+  }
+  double x = strtod(s, NULL);
+  free(s);
+  return x;
+}
+
+/* The magnitude functions below work on bare limb arrays. */
+
+int big_cmp(uint32_t* a, int an, uint32_t* b, int bn)
+{
+  if (an != bn)
+  {
+    return an < bn ? -1 : 1;
+  }
+  for (int i = an - 1; i >= 0; i--)
+  {
+    if (a[i] != b[i])
+    {
+      return a[i] < b[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+/* r = a + b, where r has room for one limb more than the longer of the
+ * two and may be either of them. Returns the length of r.
+ */
+int big_add_mag(uint32_t* r, uint32_t* a, int an, uint32_t* b, int bn)
+{
+  if (an < bn)
+  {
+    uint32_t* t = a; a = b; b = t;
+    int tn = an; an = bn; bn = tn;
+  }
+  uint32_t carry = 0;
+  int i = 0;
+  for (; i < bn; i++)
+  {
+    uint32_t s = a[i] + b[i] + carry;
+    carry = s >= BIG_BASE;
+    r[i] = carry ? s - BIG_BASE : s;
+  }
+  for (; i < an; i++)
+  {
+    uint32_t s = a[i] + carry;
+    carry = s >= BIG_BASE;
+    r[i] = carry ? s - BIG_BASE : s;
+  }
+  r[an] = carry;
+  return an + carry;
+}
+
+/* r = a - b for a >= b, r may be a. Returns the length of r. */
+int big_sub_mag(uint32_t* r, uint32_t* a, int an, uint32_t* b, int bn)
+{
+  int64_t borrow = 0;
+  for (int i = 0; i < an; i++)
+  {
+    int64_t t = (int64_t)a[i] - (i < bn ? b[i] : 0) - borrow;
+    borrow = t < 0;
+    r[i] = borrow ? t + BIG_BASE : t;
+  }
+  return big_trim(r, an);
+}
+
+/* r += x in place, r has rn limbs which is enough to hold the sum */
+void big_add_to(uint32_t* r, int rn, uint32_t* x, int xn)
+{
+  uint32_t carry = 0;
+  int i = 0;
+  for (; i < xn; i++)
+  {
+    uint32_t s = r[i] + x[i] + carry;
+    carry = s >= BIG_BASE;
+    r[i] = carry ? s - BIG_BASE : s;
+  }
+  for (; carry && i < rn; i++)
+  {
+    carry = r[i] == BIG_BASE - 1;
+    r[i] = carry ? 0 : r[i] + 1;
+  }
+}
+
+/* r = a * m for a single limb m, r has room for an + 1 limbs */
+int big_mul_limb(uint32_t* r, uint32_t* a, int an, uint32_t m)
+{
+  uint64_t carry = 0;
+  for (int i = 0; i < an; i++)
+  {
+    uint64_t t = (uint64_t)a[i] * m + carry;
+    r[i] = t % BIG_BASE;
+    carry = t / BIG_BASE;
+  }
+  r[an] = carry;
+  return an + 1;
+}
+
+/* q = u / v for a single limb v, q may be u. Returns the remainder. */
+uint32_t big_div_limb(uint32_t* q, uint32_t* u, int un, uint32_t v)
+{
+  uint64_t rem = 0;
+  for (int i = un - 1; i >= 0; i--)
+  {
+    uint64_t t = rem * BIG_BASE + u[i];
+    q[i] = t / v;
+    rem = t % v;
+  }
+  return rem;
+}
+
+/* r = a * b the schoolbook way, r gets an + bn limbs */
+void big_mul_school(uint32_t* r, uint32_t* a, int an, uint32_t* b, int bn)
+{
+  memset(r, 0, sizeof(uint32_t) * (an + bn));
+  for (int i = 0; i < an; i++)
+  {
+    uint64_t ai = a[i], carry = 0;
+    if (ai == 0)
+    {
+      continue;
+    }
+    for (int j = 0; j < bn; j++)
+    {
+      uint64_t t = r[i+j] + ai * b[j] + carry;
+      r[i+j] = t % BIG_BASE;
+      carry = t / BIG_BASE;
+    }
+    r[i+bn] = carry;
+  }
+}
+
+/* r = a * b, r gets an + bn limbs and may not overlap either. Splitting
+ * both in two halves at m limbs,
+ *
+ *   a b = a1 b1 B^2m + ((a0 + a1)(b0 + b1) - a0 b0 - a1 b1) B^m + a0 b0
+ *
+ * takes three half size products instead of four, so n limbs take
+ * O(n^1.585) rather than O(n^2). Operands of very different sizes are
+ * multiplied a piece of the longer one at a time.
+ */
+void big_mul_mag(uint32_t* r, uint32_t* a, int an, uint32_t* b, int bn)
+{
+  if (an < bn)
+  {
+    uint32_t* t = a; a = b; b = t;
+    int tn = an; an = bn; bn = tn;
+  }
+  if (bn < big_karatsuba_min)
+  {
+    big_mul_school(r, a, an, b, bn);
+    return;
+  }
+
+  if (an >= 2 * bn)
+  {
+    memset(r, 0, sizeof(uint32_t) * (an + bn));
+    uint32_t* t = big_new(2 * bn);
+    for (int i = 0; i < an; i += bn)
+    {
+      int k = an - i < bn ? an - i : bn;
+      big_mul_mag(t, a + i, k, b, bn);
+      big_add_to(r + i, an + bn - i, t, k + bn);
+    }
+    free(t);
+    return;
+  }
+
+  /* bn > an / 2 >= m, so both have a high half */
+  int m = an / 2;
+  int a1n = an - m, b1n = bn - m;
+
+  /* a0 b0 and a1 b1 go straight to where they belong in r */
+  big_mul_mag(r, a, m, b, m);
+  big_mul_mag(r + 2 * m, a + m, a1n, b + m, b1n);
+
+  uint32_t* sa = big_new(a1n + 1);
+  uint32_t* sb = big_new((m > b1n ? m : b1n) + 1);
+  int san = big_add_mag(sa, a, m, a + m, a1n);
+  int sbn = big_add_mag(sb, b, m, b + m, b1n);
+  uint32_t* z1 = big_new(san + sbn);
+  big_mul_mag(z1, sa, san, sb, sbn);
+
+  int z1n = big_trim(z1, san + sbn);
+  z1n = big_sub_mag(z1, z1, z1n, r, big_trim(r, 2 * m));
+  z1n = big_sub_mag(z1, z1, z1n, r + 2 * m, big_trim(r + 2 * m, a1n + b1n));
+  big_add_to(r + m, an + bn - m, z1, z1n);
+
+  free(sa);
+  free(sb);
+  free(z1);
+}
+
+/* Long division, Knuth's algorithm D (TAOCP vol. 2, 4.3.1). q gets the
+ * un - vn + 1 limbs of u / v and r the vn limbs of u % v, where un >= vn
+ * >= 2 and the top limb of v isn't zero.
+ */
+void big_divmod_mag(uint32_t* q, uint32_t* r, uint32_t* u, int un,
+  uint32_t* v, int vn)
+{
+  /* Scale both so the top limb of v is at least BIG_BASE / 2, then the
+   * guess for each quotient limb is at most two too big.
+   */
+  uint32_t d = BIG_BASE / (v[vn-1] + 1);
+  uint32_t* us = big_new(un + 1);
+  uint32_t* vs = big_new(vn + 1);
+  big_mul_limb(us, u, un, d);
+  big_mul_limb(vs, v, vn, d);
+  uint64_t top = vs[vn-1], next = vs[vn-2];
+
+  for (int j = un - vn; j >= 0; j--)
+  {
+    uint64_t num = (uint64_t)us[j+vn] * BIG_BASE + us[j+vn-1];
+    uint64_t qhat = num / top, rhat = num % top;
+    while (qhat >= BIG_BASE || qhat * next > rhat * BIG_BASE + us[j+vn-2])
+    {
+      qhat--;
+      rhat += top;
+      if (rhat >= BIG_BASE)
+      {
+        break;
+      }
+    }
+
+    /* us[j..j+vn] -= qhat * vs */
+    uint64_t carry = 0;
+    int64_t borrow = 0;
+    for (int i = 0; i < vn; i++)
+    {
+      uint64_t p = qhat * vs[i] + carry;
+      carry = p / BIG_BASE;
+      int64_t t = (int64_t)us[i+j] - (int64_t)(p % BIG_BASE) - borrow;
+      borrow = t < 0;
+      us[i+j] = borrow ? t + BIG_BASE : t;
+    }
+    int64_t t = (int64_t)us[j+vn] - (int64_t)carry - borrow;
+
+    /* Rarely the guess is still one too big, add one vs back */
+    if (t < 0)
+    {
+      qhat--;
+      uint32_t c = 0;
+      for (int i = 0; i < vn; i++)
+      {
+        uint32_t s = us[i+j] + vs[i] + c;
+        c = s >= BIG_BASE;
+        us[i+j] = c ? s - BIG_BASE : s;
+      }
+      t += c;
+    }
+    us[j+vn] = t;
+    q[j] = qhat;
+  }
+
+  big_div_limb(r, us, vn, d);
+  free(us);
+  free(vs);
+}
+
+/* The signed operations. Each one replaces the value of acc, y is only
+ * read and may be acc itself.
+ */
+
+void big_add(bigint* acc, bigint* y, int sub)
+{
+  int yneg = y->neg ^ sub;
+  int n = (acc->n > y->n ? acc->n : y->n) + 1;
+  uint32_t* r = big_new(n);
+  int neg = acc->neg;
+  if (acc->neg == yneg)
+  {
+    n = big_add_mag(r, acc->d, acc->n, y->d, y->n);
+  }
+  else if (big_cmp(acc->d, acc->n, y->d, y->n) >= 0)
+  {
+    n = big_sub_mag(r, acc->d, acc->n, y->d, y->n);
+  }
+  else
+  {
+    n = big_sub_mag(r, y->d, y->n, acc->d, acc->n);
+    neg = yneg;
+  }
+  big_set(acc, r, n, neg);
+}
+
+void big_mul(bigint* acc, bigint* y)
+{
+  int n = acc->n + y->n;
+  uint32_t* r = big_new(n);
+  if (acc->n == 0 || y->n == 0)
+  {
+    n = 0;
+  }
+  else
+  {
+    big_mul_mag(r, acc->d, acc->n, y->d, y->n);
+  }
+  big_set(acc, r, n, acc->neg ^ y->neg);
+}
+
+/* acc = acc / y, or acc % y with mod set. Division truncates and the
+ * remainder has the sign of acc, like with Integers. Returns -1 if y is
+ * zero.
+ */
+int big_divmod(bigint* acc, bigint* y, int mod)
+{
+  if (y->n == 0)
+  {
+    return -1;
+  }
+  if (acc->n < y->n)
+  {
+    if (!mod)
+    {
+      big_set(acc, big_new(0), 0, 0);
+    }
+    return 0;
+  }
+
+  uint32_t* q = big_new(acc->n);
+  uint32_t* r = big_new(y->n);
+  if (y->n == 1)
+  {
+    r[0] = big_div_limb(q, acc->d, acc->n, y->d[0]);
+  }
+  else
+  {
+    big_divmod_mag(q, r, acc->d, acc->n, y->d, y->n);
+  }
+  int qn = acc->n - y->n + 1;
+  if (mod)
+  {
+    free(q);
+    big_set(acc, r, y->n, acc->neg);
+  }
+  else
+  {
+    free(r);
+    big_set(acc, q, qn, acc->neg ^ y->neg);
+  }
+  return 0;
+}
+
+/* acc = acc ^ y by squaring, for y >= 0. Returns 2 if the result would
+ * have more than BIG_MAX_LIMBS limbs.
+ */
+int big_pow(bigint* acc, bigint* y)
+{
+  /* 0, 1 and -1 stay small whatever the exponent, and since the base
+   * is even the lowest limb tells if y is odd.
+   */
+  if (acc->n == 0 || (acc->n == 1 && acc->d[0] == 1))
+  {
+    if (y->n == 0)
+    {
+      uint32_t* one = big_new(1);
+      one[0] = 1;
+      big_set(acc, one, 1, 0);
+    }
+    acc->neg = acc->neg && y->n > 0 && (y->d[0] & 1);
+    return 0;
+  }
+
+  int64_t e;
+  double limbs = acc->n - 1 + log10(acc->d[acc->n-1] + 1.0) / BIG_DIGITS;
+  if (!big_to_int(y, &e) || limbs * (double)e > BIG_MAX_LIMBS)
+  {
+    return 2;
+  }
+
+  bigint r;
+  r.d = big_new(1);
+  r.d[0] = 1;
+  r.n = 1;
+  r.neg = 0;
+  while (e > 0)
+  {
+    if (e & 1)
+    {
+      big_mul(&r, acc);
+    }
+    e >>= 1;
+    if (e > 0)
+    {
+      big_mul(acc, acc);
+    }
+  }
+  big_free(acc);
+  *acc = r;
+  return 0;
+}
+
+/* Views v, an Integer or a Bignum, as a bigint without copying it */
+void lval_big_view(lval* v, bigint* b)
+{
+  if (v->type == LVAL_INT)
+  {
+    big_from_int(b, v->inum);
+    return;
+  }
+  b->d = v->limbs;
+  b->n = v->count;
+  b->neg = (v->flags & LVAL_F_NEG) != 0;
+}
+
+/* Construct a pointer to a new Integer or Bignum lval, whichever fits b.
+ * The limbs of b are taken over or freed.
+ */
+lval* lval_big(bigint* b)
+{
+  int64_t x;
+  if (big_to_int(b, &x))
+  {
+    big_free(b);
+    return lval_int(x);
+  }
+  lval* v = lval_alloc(LVAL_BIG);
+  v->count = b->n;
+  if (b->neg)
+  {
+    v->flags |= LVAL_F_NEG;
+  }
+  if ((v->flags & LVAL_F_ARENA) || b->d == b->small)
+  {
+    size_t n = sizeof(uint32_t) * b->n;
+    v->limbs = (v->flags & LVAL_F_ARENA) ? arena_alloc(&line_arena, n) : malloc(n);
+    memcpy(v->limbs, b->d, n);
+    big_free(b);
+  }
+  else
+  {
+    v->limbs = b->d;
+  }
+  return v;
+}
+
+/* Turns an Integer or a Bignum into the nearest Number, in place */
+void lval_promote(lval* v)
+{
+  if (v->type != LVAL_INT && v->type != LVAL_BIG)
+  {
+    return;
+  }
+  if (stats_enabled)
+  {
+    stats_retype(v->type, LVAL_NUM, v->flags & LVAL_F_ARENA);
+  }
+  if (v->type == LVAL_BIG)
+  {
+    bigint b;
+    lval_big_view(v, &b);
+    double x = big_to_double(&b);
+    if (!(v->flags & LVAL_F_ARENA))
+    {
+      free(v->limbs);
+    }
+    v->flags &= ~LVAL_F_NEG;
+    v->num = x;
+  }
+  else
+  {
+    v->num = (double)v->inum;
+  }
+  v->type = LVAL_NUM;
+  v->count = 0;
+}
+
+/* Construct a pointer to a new Error lval */ 
+lval* lval_err(char* m) 
+{
+  lval* v = lval_alloc(LVAL_ERR);
+  v->err = lval_strdup(v, m);
+  return v;
+}
+
+/* Construct a pointer to a new Symbol lval from the n bytes at s */ 
+lval* lval_sym_n(char* s, size_t n) 
+{
+  lval* v = lval_alloc(LVAL_SYM);
+  v->sym = intern_n(s, n);
+
+  /* Resolve the operator once here instead of on every evaluation */
+  v->op = LOP_NONE;
+  if (v->sym == sym_add) { v->op = LOP_ADD; }
+  if (v->sym == sym_sub) { v->op = LOP_SUB; }
+  if (v->sym == sym_mul) { v->op = LOP_MUL; }
+  if (v->sym == sym_div) { v->op = LOP_DIV; }
+  if (v->sym == sym_mod) { v->op = LOP_MOD; }
+  if (v->sym == sym_pow) { v->op = LOP_POW; }
+  return v;
+}
+
+/* Construct a pointer to a new Symbol lval */ 
+lval* lval_sym(char* s) 
+{
+  return lval_sym_n(s, strlen(s));
+}
+
+/* A pointer to a new empty Sexpr lval */
+lval* lval_sexpr(void) 
+{
+  lval* v = lval_alloc(LVAL_SEXPR);
+  v->count = 0;
+  v->cell = NULL;
+  return v;
+}
+
+/* A pointer to a new empty Qexpr lval */
+lval* lval_qexpr(void)
+{
+  lval* v = lval_alloc(LVAL_QEXPR);
+  v->flags |= LVAL_F_PACKED;
+  v->count = 0;
+  v->cell = NULL;
+  return v;
+}
+
+/* Turns a packed Qexpr into the ordinary boxed form, one lval per number */
+void lval_unpack(lval* v)
+{
+  double* nums = v->nums;
+  lval** cell = v->count > 0 ? lval_cells_alloc(v, v->count) : NULL;
+  for (int i = 0; i < v->count; i++)
+  {
+    cell[i] = lval_num(nums[i]);
+  }
+  lval_cells_free(v, (lval**)nums);
+  v->cell = cell;
+  v->flags &= ~LVAL_F_PACKED;
+}
+
+/* This is the explicit stack shared by the traversals that used to
+ * recurse, lval_del(), lval_write(), lval_read(), lval_deep_copy(),
+ * lval_equal(), the constant folder, the bytecode compiler and
+ * par_measure(). A frame is a list being walked and the index of its
+ * next child, so the stack only grows with the depth of the tree and
+ * never with its width. It is thread local and kept between calls, and
+ * each traversal only pops the frames it pushed itself.
+ */
+
+typedef struct walk_frame
+{
+  lval* v;
+  // The AST node lval_read() is filling v from.
+  mpc_ast_t* t;
+  int i;
+} walk_frame;
+
+typedef struct walk_stack
+{
+  walk_frame* frames;
+  int depth;
+  int cap;
+} walk_stack;
+
+static _Thread_local walk_stack walk;
+
+void walk_push(lval* v, mpc_ast_t* t)
+{
+  if (walk.depth == walk.cap)
+  {
+    walk.cap = walk.cap ? walk.cap * 2 : 64;
+    walk.frames = realloc(walk.frames, sizeof(walk_frame) * walk.cap);
+  }
+  walk.frames[walk.depth++] = (walk_frame){ v, t, 0 };
+}
+
+/* Frees v itself once its children are gone. It frees up memory of
+ * the strings err if the type is LVAL_ERR, symbol strings are interned,
+ * and for LVAL_SEXPR and LVAL_QEXPR the memory allocated to contain the
+ * pointers.
+ */
+
+void lval_free_node(lval* v)
+{
+  if (stats_enabled)
+  {
+    stats_free(v->type);
+  }
+
+  switch (v->type) 
+  {
+    /* Do nothing special for number types */
+    case LVAL_NUM: break;
+    case LVAL_INT: break;
+    case LVAL_BIG:
+      free(v->limbs); break;
+    
+    /* For Err free the string data, Sym strings are interned */
+    case LVAL_ERR:
+      free(v->err); break;
+    case LVAL_SYM: break;
+    
+    /* Give back the memory allocated to contain the pointers */
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      lval_cells_free(v, v->cell);
+    break;
+  }
+  
+  /* Finally return the "lval" struct itself to the pool */
+  pool_put(&pool.lvals, v);
+}
+
+/* Does v have boxed children that need deleting or printing first */
+int lval_has_cells(lval* v)
+{
+  return (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR)
+    && !(v->flags & LVAL_F_PACKED) && v->count > 0;
+}
+
+/* This acts as the destructor for our lval type structs. Leaves are
+ * freed straight away, a list is pushed on the walk stack and freed
+ * once all its children are, so even a tree nested millions of levels
+ * deep is deleted without recursion.
+ */
+
+void lval_del(lval* v) 
+{
+  /* Shared values just lose an owner, and so do shared children below */
+  if (v->refs > 0)
+  {
+    v->refs--;
+    return;
+  }
+
+  /* Arena values are released together with the whole line */
+  if (v->flags & LVAL_F_ARENA)
+  {
+    return;
+  }
+  if (!lval_has_cells(v))
+  {
+    lval_free_node(v);
+    return;
+  }
+
+  int base = walk.depth;
+  walk_push(v, NULL);
+  while (walk.depth > base)
+  {
+    walk_frame* f = &walk.frames[walk.depth - 1];
+    if (f->i == f->v->count)
+    {
+      walk.depth--;
+      lval_free_node(f->v);
+      continue;
+    }
+
+    lval* c = f->v->cell[f->i++];
+    if (c->refs > 0)
+    {
+      c->refs--;
+      continue;
+    }
+    if (c->flags & LVAL_F_ARENA)
+    {
+      continue;
+    }
+    if (lval_has_cells(c))
+    {
+      walk_push(c, NULL);
+    }
+    else
+    {
+      lval_free_node(c);
+    }
+  }
+}
+
+/* Values can have more than one owner. Instead of copying, lval_ref()
+ * hands out another reference to the same node, and refs counts the
+ * owners besides the first. lval_del() only frees a node once its last
+ * owner lets go of it, until then it just drops a reference.
+ *
+ * Shared nodes are never changed in place. Whatever is about to change a
+ * node calls lval_unshare() first, which does nothing when the caller is
+ * the only owner and otherwise swaps the caller's reference for a copy
+ * of that one node. The copy shares the children, which are only copied
+ * in turn if they get changed too. So changing one element of a shared
+ * Q-expression copies the lists on the path down to it, not the tree.
+ *
+ * refs is a byte so lval stays at 16 bytes. Once it is full lval_ref()
+ * makes a copy instead, which is just slower. It isn't atomic either, a
+ * tree must not be shared between threads. Nothing does, --jobs and
+ * --parallel only hand out trees that come straight from the reader.
+ */
+
+#define LVAL_REFS_MAX 255
+
+lval* lval_ref(lval* v);
+
+/* A new node with the contents of v, the children are shared */
+lval* lval_clone(lval* v)
+{
+  lval* x = lval_alloc(v->type);
+  x->flags |= v->flags & (LVAL_F_PACKED | LVAL_F_NEG);
+  x->op = v->op;
+  x->count = v->count;
+  switch (v->type)
+  {
+    case LVAL_NUM: x->num = v->num; break;
+    case LVAL_INT: x->inum = v->inum; break;
+    case LVAL_SYM: x->sym = v->sym; break;
+    case LVAL_ERR: x->err = lval_strdup(x, v->err); break;
+    case LVAL_BIG:
+    {
+      size_t n = sizeof(uint32_t) * v->count;
+      x->limbs = (x->flags & LVAL_F_ARENA) ? arena_alloc(&line_arena, n) : malloc(n);
+      memcpy(x->limbs, v->limbs, n);
+      break;
+    }
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      if (v->count == 0)
+      {
+        x->cell = NULL;
+        break;
+      }
+      x->cell = lval_cells_alloc(x, v->count);
+      if (v->flags & LVAL_F_PACKED)
+      {
+        memcpy(x->nums, v->nums, sizeof(double) * v->count);
+        break;
+      }
+      for (int i = 0; i < v->count; i++)
+      {
+        x->cell[i] = lval_ref(v->cell[i]);
+      }
+      break;
+  }
+  return x;
+}
+
+/* Another reference to v, in O(1) */
+lval* lval_ref(lval* v)
+{
+  if (v->refs == LVAL_REFS_MAX)
+  {
+    return lval_clone(v);
+  }
+  v->refs++;
+  return v;
+}
+
+/* Returns v if the caller is its only owner, and otherwise gives up the
+ * caller's reference to v in exchange for a copy the caller owns alone.
+ * Arena values are counted the same way, only their last lval_del() is a
+ * no-op. An arena list that is dropped doesn't let go of its children,
+ * so a child it shared stays shared and is copied before it is changed.
+ */
+lval* lval_unshare(lval* v)
+{
+  if (v->refs == 0)
+  {
+    return v;
+  }
+  lval* x = lval_clone(v);
+  v->refs--;
+  return x;
+}
+
+/* This function extracts the lval type expression at the passed 
+ * position and moves the remaining pointers back and returns the 
+ * extracted expression, acting like popping a value out of a stack
+ * and rearranging the remaining values. v is changed in place, so the
+ * caller has to be its only owner, see lval_unshare().
+ */
+
+lval* lval_pop(lval* v, int i) 
+{
+  /* Find the item at "i", boxing it if the list is packed */
+  lval* x = (v->flags & LVAL_F_PACKED) ? lval_num(v->nums[i]) : v->cell[i];
+  
+  /* Shift the memory following the item at "i" over the top of it,
+   * cells and packed numbers are both 8 bytes wide.
+   */
+  memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+  
+  /* Decrease the count of items in the list */
+  v->count--;
+  
+  /* Shrink lazily, only once the list is down to a quarter of its
+   * capacity, so popping and adding around a boundary doesn't thrash.
+   */
+  int cap = lval_cap(v);
+  if (cap > 8 && v->count < cap / 4)
+  {
+    lval_recap(v, cap / 2);
+  }
+  return x;
+}
+
+/* This is similar to lval_pop but instead of arrangin the remaining
+ * expressions it deletes them.
+ */
+
+lval* lval_take(lval* v, int i) 
+{
+  /* A shared list is left alone, the item just gets another owner */
+  if (v->refs > 0)
+  {
+    lval* x = (v->flags & LVAL_F_PACKED) ? lval_num(v->nums[i])
+      : lval_ref(v->cell[i]);
+    lval_del(v);
+    return x;
+  }
+  lval* x = lval_pop(v, i);
+  lval_del(v);
+  return x;
+}
+
+/* This is the output layer. Rather than one printf or putchar per node,
+ * an lval is serialized into a growable byte buffer, the writer, which
+ * is then handed to stdio with a single fwrite. Each thread has its own.
+ *
+ * Numbers are printed with the shortest digits that read back as the same
+ * double, using Grisu2 (Florian Loitsch, "Printing Floating-Point Numbers
+ * Quickly and Accurately with Integers", 2010). It multiplies the number
+ * and its rounding boundaries by a cached power of ten, so it only needs
+ * 64 bit integer arithmetic. The result always round trips and is the
+ * shortest for all but a tiny fraction of inputs. --legacy-float keeps
+ * the old printf("%f") output.
+ */
+
+typedef struct writer
+{
+  char* data;
+  size_t len;
+  size_t cap;
+} writer;
+
+static _Thread_local writer out;
+static int legacy_float = 0;
+
+/* Makes room for n more bytes */
+void writer_reserve(writer* w, size_t n)
+{
+  if (w->len + n > w->cap)
+  {
+    w->cap = w->cap * 2 > w->len + n ? w->cap * 2 : w->len + n + 4096;
+    w->data = realloc(w->data, w->cap);
+  }
+}
+
+void writer_putc(writer* w, char c)
+{
+  writer_reserve(w, 1);
+  w->data[w->len++] = c;
+}
+
+void writer_puts(writer* w, const char* s, size_t n)
+{
+  writer_reserve(w, n);
+  memcpy(w->data + w->len, s, n);
+  w->len += n;
+}
+
+/* Writes everything buffered to f and empties the buffer */
+void writer_flush(writer* w, FILE* f)
+{
+  fwrite(w->data, 1, w->len, f);
+  w->len = 0;
+}
+
+// A 64 bit significand with a binary exponent, f * 2^e.
+typedef struct diyfp
+{
+  uint64_t f;
+  int e;
+} diyfp;
+
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_HIDDEN_BIT 0x0010000000000000ULL
+
+/* Normalized 10^k for k = -348, -340 ... 340 */
+static const uint64_t grisu_powers_f[] =
+{
+  0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+  0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+  0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+  0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+  0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+  0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+  0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+  0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+  0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+  0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+  0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+  0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+  0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+  0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+  0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+  0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+  0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+  0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+  0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+  0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+  0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+  0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+  0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+  0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+  0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+  0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+  0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+  0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+  0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+static const int16_t grisu_powers_e[] =
+{
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+  -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+  -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+  -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+  -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+  109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+  641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+  907, 933, 960, 986, 1013, 1039, 1066
+};
+
+diyfp diyfp_from_double(double d)
+{
+  uint64_t u;
+  memcpy(&u, &d, sizeof(u));
+  int biased = (int)((u >> DP_SIGNIFICAND_SIZE) & 0x7FF);
+  uint64_t significand = u & (DP_HIDDEN_BIT - 1);
+  if (biased != 0)
+  {
+    return (diyfp){ significand + DP_HIDDEN_BIT, biased - DP_EXPONENT_BIAS };
+  }
+  return (diyfp){ significand, 1 - DP_EXPONENT_BIAS };
+}
+
+/* The upper 64 bits of the product, rounded */
+diyfp diyfp_mul(diyfp x, diyfp y)
+{
+  const uint64_t M32 = 0xFFFFFFFFULL;
+  uint64_t a = x.f >> 32, b = x.f & M32, c = y.f >> 32, d = y.f & M32;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (1ULL << 31);
+  return (diyfp){ ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64 };
+}
+
+/* Shifts x left until the top bit is set */
+diyfp diyfp_normalize(diyfp x)
+{
+  while (!(x.f & (1ULL << 63)))
+  {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+/* Rounds the last digit down while that stays inside the boundaries and
+ * moves closer to the real value.
+ */
+
+void grisu_round(char* buf, int len, uint64_t delta, uint64_t rest,
+  uint64_t ten_kappa, uint64_t wp_w)
+{
+  while (rest < wp_w && delta - rest >= ten_kappa
+    && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w))
+  {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+/* Generates the digits of mp, stopping as soon as what is left is within
+ * delta, so the number is still inside its rounding boundaries.
+ */
+
+int grisu_digits(diyfp w, diyfp mp, uint64_t delta, char* buf, int* k)
+{
+  static const uint64_t pow10[] =
+  {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL
+  };
+  diyfp one = { 1ULL << -mp.e, mp.e };
+  uint64_t wp_w = mp.f - w.f;
+  uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+  uint64_t p2 = mp.f & (one.f - 1);
+  int len = 0;
+
+  /* Integer part */
+  int kappa = 1;
+  while (kappa < 10 && p1 >= pow10[kappa])
+  {
+    kappa++;
+  }
+  while (kappa > 0)
+  {
+    uint32_t d = (uint32_t)(p1 / pow10[kappa - 1]);
+    p1 %= (uint32_t)pow10[kappa - 1];
+    if (d || len)
+    {
+      buf[len++] = (char)('0' + d);
+    }
+    kappa--;
+    uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+    if (rest <= delta)
+    {
+      *k += kappa;
+      grisu_round(buf, len, delta, rest, pow10[kappa] << -one.e, wp_w);
+      return len;
+    }
+  }
+
+  /* Fraction part */
+  while (1)
+  {
+    p2 *= 10;
+    delta *= 10;
+    char d = (char)(p2 >> -one.e);
+    if (d || len)
+    {
+      buf[len++] = (char)('0' + d);
+    }
+    p2 &= one.f - 1;
+    kappa--;
+    if (p2 < delta)
+    {
+      *k += kappa;
+      grisu_round(buf, len, delta, p2, one.f,
+        -kappa < 20 ? wp_w * pow10[-kappa] : 0);
+      return len;
+    }
+  }
+}
+
+/* Shortest digits of a positive, finite x, with x = digits * 10^k */
+int grisu2(double x, char* buf, int* k)
+{
+  diyfp v = diyfp_from_double(x);
+
+  /* The boundaries halfway to the neighbouring doubles */
+  diyfp plus = diyfp_normalize((diyfp){ (v.f << 1) + 1, v.e - 1 });
+  diyfp minus = v.f == DP_HIDDEN_BIT
+    ? (diyfp){ (v.f << 2) - 1, v.e - 2 }
+    : (diyfp){ (v.f << 1) - 1, v.e - 1 };
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+
+  /* Pick the cached power that brings the exponent into [-60, -32] */
+  double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+  int ik = (int)dk;
+  if (dk - ik > 0.0)
+  {
+    ik++;
+  }
+  int index = (ik >> 3) + 1;
+  *k = -(-348 + (index << 3));
+  diyfp c = { grisu_powers_f[index], grisu_powers_e[index] };
+
+  diyfp w = diyfp_mul(diyfp_normalize(v), c);
+  diyfp wp = diyfp_mul(plus, c);
+  diyfp wm = diyfp_mul(minus, c);
+  wm.f++;
+  wp.f--;
+  return grisu_digits(w, wp, wp.f - wm.f, buf, k);
+}
+
+/* Writes an Integer, which has no decimal point so it reads back as one.
+ * The digits come out backwards into a small buffer, working on the
+ * magnitude as unsigned so INT64_MIN needs no special case.
+ */
+
+void writer_int(writer* w, int64_t x)
+{
+  char tmp[24];
+  char* p = tmp + sizeof(tmp);
+  uint64_t u = x < 0 ? -(uint64_t)x : (uint64_t)x;
+  do
+  {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u > 0);
+  if (x < 0)
+  {
+    *--p = '-';
+  }
+  writer_puts(w, p, tmp + sizeof(tmp) - p);
+}
+
+/* Writes a Bignum. Every limb but the top one is exactly 9 digits, so
+ * this is a single pass with no division by anything but constants.
+ */
+
+void writer_big(writer* w, lval* v)
+{
+  writer_reserve(w, (size_t)v->count * BIG_DIGITS + 1);
+  if (v->flags & LVAL_F_NEG)
+  {
+    writer_putc(w, '-');
+  }
+  writer_int(w, v->limbs[v->count-1]);
+  char* p = w->data + w->len;
+  for (int i = v->count - 2; i >= 0; i--)
+  {
+    uint32_t x = v->limbs[i];
+    for (int k = BIG_DIGITS - 1; k >= 0; k--)
+    {
+      p[k] = '0' + x % 10;
+      x /= 10;
+    }
+    p += BIG_DIGITS;
+  }
+  w->len = p - w->data;
+}
+
+/* Writes x in the shortest form that reads back as x. There is always a
+ * decimal point, like the reader expects, and an exponent once the plain
+ * form would be too long.
+ */
+
+void writer_num(writer* w, double x)
+{
+  if (legacy_float)
+  {
+    char tmp[512];
+    writer_puts(w, tmp, (size_t)snprintf(tmp, sizeof(tmp), "%f", x));
+    return;
+  }
+  if (isnan(x))
+  {
+    writer_puts(w, "nan", 3);
+    return;
+  }
+  if (signbit(x))
+  {
+    writer_putc(w, '-');
+    x = -x;
+  }
+  if (isinf(x))
+  {
+    writer_puts(w, "inf", 3);
+    return;
+  }
+  if (x == 0)
+  {
+    writer_puts(w, "0.0", 3);
+    return;
+  }
+
+  char digits[24];
+  int k;
+  int len = grisu2(x, digits, &k);
+
+  /* 10^(point - 1) <= x < 10^point */
+  int point = len + k;
+  writer_reserve(w, 32);
+  char* p = w->data + w->len;
+  if (len <= point && point <= 21)
+  {
+    /* 1234e3 -> 1234000.0 */
+    memcpy(p, digits, len);
+    memset(p + len, '0', point - len);
+    p += point;
+    *p++ = '.';
+    *p++ = '0';
+  }
+  else if (0 < point && point <= 21)
+  {
+    /* 1234e-2 -> 12.34 */
+    memcpy(p, digits, point);
+    p[point] = '.';
+    memcpy(p + point + 1, digits + point, len - point);
+    p += len + 1;
+  }
+  else if (-6 < point && point <= 0)
+  {
+    /* 1234e-6 -> 0.001234 */
+    *p++ = '0';
+    *p++ = '.';
+    memset(p, '0', -point);
+    p += -point;
+    memcpy(p, digits, len);
+    p += len;
+  }
+  else
+  {
+    /* 1234e30 -> 1.234e33 */
+    *p++ = digits[0];
+    *p++ = '.';
+    if (len > 1)
+    {
+      memcpy(p, digits + 1, len - 1);
+      p += len - 1;
+    }
+    else
+    {
+      *p++ = '0';
+    }
+    p += sprintf(p, "e%d", point - 1);
+  }
+  w->len = p - w->data;
+}
+
+/* Writes a value that has no boxed children, packed lists included */
+void lval_write_atom(writer* w, lval* v)
+{
+  switch (v->type) 
+  {
+    case LVAL_NUM:
+      writer_num(w, v->num);
+      break;
+    case LVAL_INT:
+      writer_int(w, v->inum);
+      break;
+    case LVAL_BIG:
+      writer_big(w, v);
+      break;
+    case LVAL_ERR:
+      writer_puts(w, "Error: ", 7);
+      writer_puts(w, v->err, strlen(v->err));
+      break;
+    case LVAL_SYM:
+      writer_puts(w, v->sym, strlen(v->sym));
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      writer_putc(w, v->type == LVAL_SEXPR ? '(' : '{');
+      for (int i = 0; i < v->count; i++)
+      {
+        /* Don't print trailing space if last element */
+        if (i > 0)
+        {
+          writer_putc(w, ' ');
+        }
+        writer_num(w, v->nums[i]);
+      }
+      writer_putc(w, v->type == LVAL_SEXPR ? ')' : '}');
+  }
+}
+
+/* This function walks through all the cells in the passed lval and
+ * writes them out with a space in between, lists inside it are pushed
+ * on the walk stack instead of recursing into them.
+ */
+
+void lval_expr_write(writer* w, lval* v, char open, char close) 
+{
+  writer_putc(w, open);
+  int base = walk.depth;
+  walk_push(v, NULL);
+  while (walk.depth > base)
+  {
+    walk_frame* f = &walk.frames[walk.depth - 1];
+    if (f->i == f->v->count)
+    {
+      walk.depth--;
+      writer_putc(w, walk.depth == base ? close
+        : (f->v->type == LVAL_SEXPR ? ')' : '}'));
+      continue;
+    }
+
+    /* Don't print a space before the first element */
+    if (f->i > 0)
+    {
+      writer_putc(w, ' ');
+    }
+    lval* c = f->v->cell[f->i++];
+    if (lval_has_cells(c))
+    {
+      writer_putc(w, c->type == LVAL_SEXPR ? '(' : '{');
+      walk_push(c, NULL);
+    }
+    else
+    {
+      lval_write_atom(w, c);
+    }
+  }
+}
+
+/* Serializes v onto the end of w */
+void lval_write(writer* w, lval* v) 
+{
+  if (!lval_has_cells(v))
+  {
+    lval_write_atom(w, v);
+    return;
+  }
+  if (v->type == LVAL_SEXPR)
+  {
+    lval_expr_write(w, v, '(', ')');
+  }
+  else
+  {
+    lval_expr_write(w, v, '{', '}');
+  }
+}
+
+void lval_print(lval* v) 
+{
+  lval_write(&out, v);
+  writer_flush(&out, stdout);
+}
+
+void lval_println(lval* v) 
+{
+  lval_write(&out, v);
+  writer_putc(&out, '\n');
+  writer_flush(&out, stdout);
+}
+
+/* Vectorized reductions for + - and *.
+ * When an operator has enough operands their doubles are gathered into a
+ * contiguous buffer and summed (or multiplied) with SIMD. So that every
+ * code path gives bit for bit the same answer, the order of operations is
+ * fixed, whatever instruction set ends up running it:
+ *
+ *   - fewer than SIMD_MIN values are folded left to right as before.
+ *   - otherwise SIMD_LANES running lanes start at v0..v15, lane j takes
+ *     every v[i] with i % 16 == j up to the last full block of sixteen,
+ *     the lanes are combined pairwise by halving, lane j with lane j + 8,
+ *     then j + 4, j + 2 and j + 1, and the leftover values are then
+ *     folded in left to right.
+ *
+ * For - the first operand is kept apart, v0 - (v1 + ... + vn) with the
+ * sum taken in that same order. Sixteen lanes are enough independent
+ * chains to keep the adders busy. The AVX2 and SSE2 versions are picked
+ * at startup by simd_init() when the CPU has them, and the scalar version
+ * is the fallback everywhere else.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LISPY_X86 1
+#include <immintrin.h>
+#endif
+
+#define SIMD_LANES 16
+#define SIMD_MIN 32
+
+/* Combines the lanes in l and folds in the values from i to n */
+double lreduce_finish(double* l, double* xs, int i, int n, int op)
+{
+  for (int w = SIMD_LANES / 2; w > 0; w /= 2)
+  {
+    for (int j = 0; j < w; j++)
+    {
+      l[j] = op == LOP_MUL ? l[j] * l[j+w] : l[j] + l[j+w];
+    }
+  }
+  double acc = l[0];
+  for (; i < n; i++)
+  {
+    acc = op == LOP_MUL ? acc * xs[i] : acc + xs[i];
+  }
+  return acc;
+}
+
+double lreduce_scalar(double* xs, int n, int op)
+{
+  if (n < SIMD_MIN)
+  {
+    double acc = xs[0];
+    for (int i = 1; i < n; i++)
+    {
+      acc = op == LOP_MUL ? acc * xs[i] : acc + xs[i];
+    }
+    return acc;
+  }
+
+  double l[SIMD_LANES];
+  memcpy(l, xs, sizeof(l));
+  int i = SIMD_LANES;
+  if (op == LOP_MUL)
+  {
+    for (; i + SIMD_LANES <= n; i += SIMD_LANES)
+    {
+      for (int j = 0; j < SIMD_LANES; j++) { l[j] *= xs[i+j]; }
+    }
+  }
+  else
+  {
+    for (; i + SIMD_LANES <= n; i += SIMD_LANES)
+    {
+      for (int j = 0; j < SIMD_LANES; j++) { l[j] += xs[i+j]; }
+    }
+  }
+  return lreduce_finish(l, xs, i, n, op);
+}
+
+#ifdef LISPY_X86
+
+/* Eight SSE2 registers of two lanes each */
+__attribute__((target("sse2")))
+double lreduce_sse2(double* xs, int n, int op)
+{
+  if (n < SIMD_MIN)
+  {
+    return lreduce_scalar(xs, n, op);
+  }
+
+  __m128d a[SIMD_LANES / 2];
+  for (int j = 0; j < SIMD_LANES / 2; j++)
+  {
+    a[j] = _mm_loadu_pd(xs + 2 * j);
+  }
+
+  int i = SIMD_LANES;
+  if (op == LOP_MUL)
+  {
+    for (; i + SIMD_LANES <= n; i += SIMD_LANES)
+    {
+      for (int j = 0; j < SIMD_LANES / 2; j++)
+      {
+        a[j] = _mm_mul_pd(a[j], _mm_loadu_pd(xs + i + 2 * j));
+      }
+    }
+  }
+  else
+  {
+    for (; i + SIMD_LANES <= n; i += SIMD_LANES)
+    {
+      for (int j = 0; j < SIMD_LANES / 2; j++)
+      {
+        a[j] = _mm_add_pd(a[j], _mm_loadu_pd(xs + i + 2 * j));
+      }
+    }
+  }
+
+  double l[SIMD_LANES];
+  for (int j = 0; j < SIMD_LANES / 2; j++)
+  {
+    _mm_storeu_pd(l + 2 * j, a[j]);
+  }
+  return lreduce_finish(l, xs, i, n, op);
+}
+
+/* Four AVX2 registers of four lanes each */
+__attribute__((target("avx2")))
+double lreduce_avx2(double* xs, int n, int op)
+{
+  if (n < SIMD_MIN)
+  {
+    return lreduce_scalar(xs, n, op);
+  }
+
+  __m256d a0 = _mm256_loadu_pd(xs);
+  __m256d a1 = _mm256_loadu_pd(xs + 4);
+  __m256d a2 = _mm256_loadu_pd(xs + 8);
+  __m256d a3 = _mm256_loadu_pd(xs + 12);
+
+  int i = SIMD_LANES;
+  if (op == LOP_MUL)
+  {
+    for (; i + SIMD_LANES <= n; i += SIMD_LANES)
+    {
+      a0 = _mm256_mul_pd(a0, _mm256_loadu_pd(xs + i));
+      a1 = _mm256_mul_pd(a1, _mm256_loadu_pd(xs + i + 4));
+      a2 = _mm256_mul_pd(a2, _mm256_loadu_pd(xs + i + 8));
+      a3 = _mm256_mul_pd(a3, _mm256_loadu_pd(xs + i + 12));
+    }
+  }
+  else
+  {
+    for (; i + SIMD_LANES <= n; i += SIMD_LANES)
+    {
+      a0 = _mm256_add_pd(a0, _mm256_loadu_pd(xs + i));
+      a1 = _mm256_add_pd(a1, _mm256_loadu_pd(xs + i + 4));
+      a2 = _mm256_add_pd(a2, _mm256_loadu_pd(xs + i + 8));
+      a3 = _mm256_add_pd(a3, _mm256_loadu_pd(xs + i + 12));
+    }
+  }
+
+  double l[SIMD_LANES];
+  _mm256_storeu_pd(l, a0);
+  _mm256_storeu_pd(l + 4, a1);
+  _mm256_storeu_pd(l + 8, a2);
+  _mm256_storeu_pd(l + 12, a3);
+  return lreduce_finish(l, xs, i, n, op);
+}
+
+#endif
+
+/* The reduction in use, see simd_init() */
+double (*lreduce)(double*, int, int) = lreduce_scalar;
+
+/* Picks the widest reduction the CPU supports. With disable set the
+ * scalar fallback is used, which --no-simd and the benchmarks rely on.
+ */
+
+void simd_init(int disable)
+{
+  lreduce = lreduce_scalar;
+#ifdef LISPY_X86
+  if (disable)
+  {
+    return;
+  }
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    lreduce = lreduce_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    lreduce = lreduce_sse2;
+  }
+#endif
+}
+
+/* A per thread scratch buffer the operands are gathered into */
+static _Thread_local double* gather_buf;
+static _Thread_local int gather_cap;
+
+double* lreduce_buffer(int n)
+{
+  if (n > gather_cap)
+  {
+    gather_cap = n < 1024 ? 1024 : n;
+    free(gather_buf);
+    gather_buf = malloc(sizeof(double) * gather_cap);
+  }
+  return gather_buf;
+}
+
+/* These are the reduction loops for each operator. Each one folds the
+ * n operands in args into x in place and returns the result. They are
+ * picked once per call through builtin_table, so the loops themselves
+ * don't have to check which operator they are running. The operands are
+ * left where they are, builtin_op frees them all at once afterwards.
+ */
+
+lval* builtin_add(lval* x, lval** args, int n)
+{
+  if (n + 1 >= SIMD_MIN)
+  {
+    double* xs = lreduce_buffer(n + 1);
+    xs[0] = x->num;
+    for (int i = 0; i < n; i++)
+    {
+      xs[i+1] = args[i]->num;
+    }
+    x->num = lreduce(xs, n + 1, LOP_ADD);
+    return x;
+  }
+  for (int i = 0; i < n; i++)
+  {
+    x->num += args[i]->num;
+  }
+  return x;
+}
+
+lval* builtin_sub(lval* x, lval** args, int n)
+{
+  /* If no arguments then perform unary negation */
+  if (n == 0)
+  {
+    x->num = -x->num;
+  }
+  if (n >= SIMD_MIN)
+  {
+    double* xs = lreduce_buffer(n);
+    for (int i = 0; i < n; i++)
+    {
+      xs[i] = args[i]->num;
+    }
+    x->num -= lreduce(xs, n, LOP_ADD);
+    return x;
+  }
+  for (int i = 0; i < n; i++)
+  {
+    x->num -= args[i]->num;
+  }
+  return x;
+}
+
+lval* builtin_mul(lval* x, lval** args, int n)
+{
+  if (n + 1 >= SIMD_MIN)
+  {
+    double* xs = lreduce_buffer(n + 1);
+    xs[0] = x->num;
+    for (int i = 0; i < n; i++)
+    {
+      xs[i+1] = args[i]->num;
+    }
+    x->num = lreduce(xs, n + 1, LOP_MUL);
+    return x;
+  }
+  for (int i = 0; i < n; i++)
+  {
+    x->num *= args[i]->num;
+  }
+  return x;
+}
+
+lval* builtin_div(lval* x, lval** args, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    if (args[i]->num == 0)
+    {
+      lval_del(x);
+      return lval_err("Division By Zero.");
+    }
+    x->num /= args[i]->num;
+  }
+  return x;
+}
+
+lval* builtin_mod(lval* x, lval** args, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    x->num = fmod(x->num, args[i]->num);
+  }
+  return x;
+}
+
+lval* builtin_pow(lval* x, lval** args, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    x->num = pow(x->num, args[i]->num);
+  }
+  return x;
+}
+
+lval* builtin_unknown(lval* x, lval** args, int n)
+{
+  (void)args;
+  (void)n;
+  lval_del(x);
+  return lval_err("Unknown operator.");
+}
+
+/* Jump table from opcode to reduction loop */
+lval* (*builtin_table[LOP_COUNT])(lval*, lval**, int) =
+{
+  [LOP_NONE] = builtin_unknown,
+  [LOP_ADD]  = builtin_add,
+  [LOP_SUB]  = builtin_sub,
+  [LOP_MUL]  = builtin_mul,
+  [LOP_DIV]  = builtin_div,
+  [LOP_MOD]  = builtin_mod,
+  [LOP_POW]  = builtin_pow,
+};
+
+/* Element-wise arithmetic on packed Q-expressions. Folds the n element
+ * y into x, which must be the same length, one tight loop per operator.
+ * Returns an error message or NULL.
+ */
+
+char* lvec_apply(int op, double* x, double* y, int n)
+{
+  switch (op)
+  {
+    case LOP_ADD: for (int i = 0; i < n; i++) { x[i] += y[i]; } break;
+    case LOP_SUB: for (int i = 0; i < n; i++) { x[i] -= y[i]; } break;
+    case LOP_MUL: for (int i = 0; i < n; i++) { x[i] *= y[i]; } break;
+    case LOP_DIV:
+      for (int i = 0; i < n; i++)
+      {
+        if (y[i] == 0) { return "Division By Zero."; }
+      }
+      for (int i = 0; i < n; i++) { x[i] /= y[i]; }
+      break;
+    case LOP_MOD: for (int i = 0; i < n; i++) { x[i] = fmod(x[i], y[i]); } break;
+    case LOP_POW: for (int i = 0; i < n; i++) { x[i] = pow(x[i], y[i]); } break;
+    default: return "Unknown operator.";
+  }
+  return NULL;
+}
+
+/* Applies op element by element across the n packed lists in args,
+ * folding operands left to right into x, which is updated in place.
+ * A single list with - is negated. Returns an error message or NULL.
+ */
+
+char* lvec_reduce(int op, lval* x, lval** args, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    if (args[i]->count != x->count)
+    {
+      return "Vector length mismatch.";
+    }
+  }
+  if (op == LOP_SUB && n == 0)
+  {
+    for (int i = 0; i < x->count; i++) { x->nums[i] = -x->nums[i]; }
+  }
+  for (int i = 0; i < n; i++)
+  {
+    char* err = lvec_apply(op, x->nums, args[i]->nums, x->count);
+    if (err != NULL)
+    {
+      return err;
+    }
+  }
+  return NULL;
+}
+
+/* These are the Integer versions of the operators. Each step folds y
+ * into *acc and returns 0, or returns 1 without touching *acc when the
+ * exact result doesn't fit in 64 bits, in which case the caller carries
+ * on with Bignums from that operand. Dividing by zero returns -1.
+ *
+ * Division truncates towards zero and % is the native one, which has the
+ * same sign as fmod(). ^ is done by squaring, a negative exponent can't
+ * give an Integer so it counts as overflowing too, big_reduce() then
+ * hands it over to the double loops.
+ */
+
+int lint_pow(int64_t* acc, int64_t e)
+{
+  if (e < 0)
+  {
+    return 1;
+  }
+  int64_t base = *acc, r = 1;
+  while (e > 0)
+  {
+    if ((e & 1) && __builtin_mul_overflow(r, base, &r))
+    {
+      return 1;
+    }
+    e >>= 1;
+    /* Only square when a higher bit still needs it, so overflowing
+     * here means the result would overflow too.
+     */
+    if (e > 0 && __builtin_mul_overflow(base, base, &base))
+    {
+      return 1;
+    }
+  }
+  *acc = r;
+  return 0;
+}
+
+int lint_step(int op, int64_t* acc, int64_t y)
+{
+  int64_t r;
+  switch (op)
+  {
+    case LOP_ADD:
+      if (__builtin_add_overflow(*acc, y, &r)) { return 1; }
+      break;
+    case LOP_SUB:
+      if (__builtin_sub_overflow(*acc, y, &r)) { return 1; }
+      break;
+    case LOP_MUL:
+      if (__builtin_mul_overflow(*acc, y, &r)) { return 1; }
+      break;
+    case LOP_DIV:
+      if (y == 0) { return -1; }
+      if (*acc == INT64_MIN && y == -1) { return 1; }
+      r = *acc / y;
+      break;
+    case LOP_MOD:
+      if (y == 0) { return -1; }
+      r = y == -1 ? 0 : *acc % y;
+      break;
+    case LOP_POW:
+      return lint_pow(acc, y);
+    default:
+      return 1;
+  }
+  *acc = r;
+  return 0;
+}
+
+/* Unary minus, 1 if x is INT64_MIN */
+int lint_negate(int64_t* acc)
+{
+  if (*acc == INT64_MIN)
+  {
+    return 1;
+  }
+  *acc = -*acc;
+  return 0;
+}
+
+/* The error for a status returned by lint_step() or big_reduce() */
+char* lint_error(int op, int r)
+{
+  if (r == 2)
+  {
+    return "Integer too large.";
+  }
+  return op == LOP_MOD ? "Modulo By Zero." : "Division By Zero.";
+}
+
+/* Folds the n operands in xs into acc, the first one being the starting
+ * value. Returns 0 when done, -1 on a zero divisor and 2 when a power is
+ * too big to make. A negative exponent returns 1 with *at set to its
+ * index, acc then holds everything up to it and the caller finishes the
+ * reduction in double.
+ */
+
+int big_reduce(int op, bigint* acc, bigint* xs, int n, int* at)
+{
+  big_copy(acc, &xs[0]);
+  if (op == LOP_SUB && n == 1)
+  {
+    acc->neg = acc->n > 0 && !acc->neg;
+  }
+  for (int i = 1; i < n; i++)
+  {
+    bigint* y = &xs[i];
+    int r = 0;
+    switch (op)
+    {
+      case LOP_ADD: big_add(acc, y, 0); break;
+      case LOP_SUB: big_add(acc, y, 1); break;
+      case LOP_MUL: big_mul(acc, y); break;
+      case LOP_DIV: r = big_divmod(acc, y, 0); break;
+      case LOP_MOD: r = big_divmod(acc, y, 1); break;
+      case LOP_POW:
+        if (y->neg)
+        {
+          *at = i;
+          return 1;
+        }
+        r = big_pow(acc, y);
+        break;
+    }
+    if (r != 0)
+    {
+      return r;
+    }
+  }
+  return 0;
+}
+
+/* builtin_op() for when every operand is an Integer or a Bignum and at
+ * least one of them is a Bignum.
+ */
+
+lval* builtin_big(int op, lval* x, lval** args, int n)
+{
+  if (op == LOP_NONE)
+  {
+    return builtin_table[LOP_NONE](x, args, n);
+  }
+
+  bigint* xs = malloc(sizeof(bigint) * (n + 1));
+  lval_big_view(x, &xs[0]);
+  for (int i = 0; i < n; i++)
+  {
+    lval_big_view(args[i], &xs[i+1]);
+  }
+  bigint acc;
+  int at;
+  int r = big_reduce(op, &acc, xs, n + 1, &at);
+  free(xs);
+  lval_del(x);
+
+  if (r < 0 || r == 2)
+  {
+    big_free(&acc);
+    return lval_err(lint_error(op, r));
+  }
+  x = lval_big(&acc);
+  if (r > 0)
+  {
+    lval_promote(x);
+    for (int j = at - 1; j < n; j++)
+    {
+      args[j] = lval_unshare(args[j]);
+      lval_promote(args[j]);
+    }
+    return builtin_table[op](x, args + at - 1, n - at + 1);
+  }
+  return x;
+}
+
+/* builtin_op() for when every operand is an Integer. If a step overflows
+ * the rest is done by builtin_big(), starting from the accumulator so far.
+ */
+
+lval* builtin_int(int op, lval* x, lval** args, int n)
+{
+  if (op == LOP_NONE)
+  {
+    return builtin_table[LOP_NONE](x, args, n);
+  }
+
+  int64_t acc = x->inum;
+  int i = 0, r = 0;
+  if (op == LOP_SUB && n == 0)
+  {
+    r = lint_negate(&acc);
+  }
+  while (r == 0 && i < n)
+  {
+    r = lint_step(op, &acc, args[i]->inum);
+    i += r == 0;
+  }
+  if (r < 0)
+  {
+    lval_del(x);
+    return lval_err(lint_error(op, r));
+  }
+
+  x->inum = acc;
+  if (r > 0)
+  {
+    return builtin_big(op, x, args + i, n - i);
+  }
+  return x;
+}
+
+/* Returns 1 if v is a Number, an Integer or a Bignum */
+int lval_is_number(lval* v)
+{
+  return v->type == LVAL_NUM || v->type == LVAL_INT || v->type == LVAL_BIG;
+}
+
+/* Returns 1 if v is a Q-expression of numbers only, packed or not */
+int lval_is_vec(lval* v)
+{
+  if (v->type != LVAL_QEXPR)
+  {
+    return 0;
+  }
+  if (v->flags & LVAL_F_PACKED)
+  {
+    return 1;
+  }
+  for (int i = 0; i < v->count; i++)
+  {
+    if (!lval_is_number(v->cell[i]))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+lval* builtin_vec(lval* a, int op);
+
+/* This function is used to evaluate expressions. It takes an pointer 
+ * to an evaluated s-expression, whose first cell is the operator symbol
+ * and the rest its operands, and the opcode of the operator to apply.
+ * It chekcs if all the operands are numbers. If it finds an error then
+ * it deletes the passed lval and then returns a new lval of the type
+ * LVAL_ERR by calling the lval_err() function.
+ *
+ * The first operand is used as the accumulator and the reduction loop
+ * for the opcode folds the remaining operands into it where they sit in
+ * the cell array, so a call with n operands is O(n). The accumulator is
+ * then swapped out of the expression and everything else, operator
+ * included, is deleted in a single lval_del().
+ *
+ * If instead every operand is a Q-expression of numbers the operator is
+ * applied element by element. Packed lists of doubles go through the
+ * packed loops, anything else, like {1 2} of Integers, through
+ * builtin_vec().
+ *
+ * Integers stay Integers as long as every operand is one, see
+ * builtin_int(), and become Bignums when they overflow. Mixing them with
+ * doubles turns them all into doubles first, so (+ 1 0.5) is 1.5.
+ */
+
+lval* builtin_op(lval* a, int op) 
+{
+  
+  /* Ensure all arguments are numbers, or all are lists of numbers */
+  int nums = 0, ints = 0, bigs = 0, vecs = 0, packed = 0;
+  for (int i = 1; i < a->count; i++) 
+  {
+    nums += a->cell[i]->type == LVAL_NUM;
+    ints += a->cell[i]->type == LVAL_INT;
+    bigs += a->cell[i]->type == LVAL_BIG;
+    vecs += lval_is_vec(a->cell[i]);
+    packed += (a->cell[i]->flags & LVAL_F_PACKED) != 0;
+  }
+  if (nums + ints + bigs != a->count - 1 && vecs != a->count - 1)
+  {
+    lval_del(a);
+    return lval_err("Cannot operator on non number!");
+  }
+  if (vecs > 0 && packed != vecs)
+  {
+    return builtin_vec(a, op);
+  }
+  
+  /* Reduce the operands into the first one, which is changed in place */
+  lval* x = a->cell[1] = lval_unshare(a->cell[1]);
+  if (vecs > 0)
+  {
+    char* err = lvec_reduce(op, x, a->cell + 2, a->count - 2);
+    if (err != NULL)
+    {
+      lval_del(a);
+      return lval_err(err);
+    }
+  }
+  else if (ints + bigs == a->count - 1)
+  {
+    x = bigs > 0 ? builtin_big(op, x, a->cell + 2, a->count - 2)
+      : builtin_int(op, x, a->cell + 2, a->count - 2);
+  }
+  else
+  {
+    for (int i = 1; i < a->count && ints + bigs > 0; i++)
+    {
+      if (a->cell[i]->type != LVAL_NUM)
+      {
+        a->cell[i] = lval_unshare(a->cell[i]);
+        lval_promote(a->cell[i]);
+      }
+    }
+    x = builtin_table[op](x, a->cell + 2, a->count - 2);
+  }
+
+  /* Take the accumulator out, the order of the rest doesn't matter */
+  a->cell[1] = a->cell[a->count-1];
+  a->count--;
+  
+  /* Delete input expression and return result */
+  lval_del(a);
+  return x;
+}
+
+lval* lval_add(lval* v, lval* x);
+
+/* builtin_op() for lists of numbers that aren't all packed doubles. The
+ * operator goes through builtin_op() once per element, as (op a_j b_j
+ * ...), so Integers and Bignums keep their exact arithmetic and errors
+ * and (/ {7} {2}) is {3} just like (/ 7 2) is 3.
+ */
+
+lval* builtin_vec(lval* a, int op)
+{
+  int len = a->cell[1]->count;
+  for (int i = 2; i < a->count; i++)
+  {
+    if (a->cell[i]->count != len)
+    {
+      lval_del(a);
+      return lval_err("Vector length mismatch.");
+    }
+  }
+
+  lval* x = lval_qexpr();
+  for (int j = 0; j < len; j++)
+  {
+    lval* e = lval_sexpr();
+    lval_reserve(e, a->count);
+    e = lval_add(e, lval_ref(a->cell[0]));
+    for (int i = 1; i < a->count; i++)
+    {
+      lval* v = a->cell[i];
+      e = lval_add(e, (v->flags & LVAL_F_PACKED) ? lval_num(v->nums[j])
+        : lval_ref(v->cell[j]));
+    }
+    lval* r = builtin_op(e, op);
+    if (r->type == LVAL_ERR)
+    {
+      lval_del(x);
+      lval_del(a);
+      return r;
+    }
+    x = lval_add(x, r);
+  }
+  lval_del(a);
+  return x;
+}
+
+/* This again is a function prototype to resolve interdependencies.*/
+lval* lval_eval_recursive(lval* v);
+
+/* This function is called by lval_eval_recursive() to evaluate s-expressions. 
+ * The two functions recursively call each other, this function first 
+ * evaluates the last expression and recursively moves on to the First.
+ * Once it gets the last expression in the cell field, it then ckecks if 
+ * any of the the expressions are of the type LVAL_ERR and if they are 
+ * it calls lval_take() with the value of i at that iteration and returns
+ * the value that lval_take() returns. 
+ *
+ * If no errors are present, it then checks if it's an empty expression, 
+ * if so it returns the Expression
+ *
+ * Then it checks if it's a single expression, and calls lval_take() and
+ * returns the value.
+ *
+ * Lastly it checks if the first element (expression in the first cell) is
+ * of the type LVAL_SYM, if it isn't it deletes the passed lval and
+ * returns an calls lval_err() with an error message.
+ *
+ * It calls builtin_op() with the Symbol's opcode and the whole passed
+ * expression, the symbol is left in the first cell so the operands don't
+ * have to be shifted down, and returns the result.
+ */
+
+lval* lval_sexpr_apply(lval* v);
+
+lval* lval_eval_sexpr(lval* v) 
+{
+  
+  /* Evaluate Children */
+  for (int i = 0; i < v->count; i++) 
+  {
+    v->cell[i] = lval_eval_recursive(v->cell[i]);
+  }
+  
+  return lval_sexpr_apply(v);
+}
+
+/* This is the rest of lval_eval_sexpr(), once every child of v has been
+ * evaluated. It is split out so the parallel evaluator can share it.
+ */
+
+lval* lval_sexpr_apply(lval* v)
+{
+  /* Error Checking */
+  for (int i = 0; i < v->count; i++) 
+  {
+    if (v->cell[i]->type == LVAL_ERR) 
+    {
+      return lval_take(v, i); 
+    }
+  }
+  
+  /* Empty Expression */
+  if (v->count == 0) 
+  {
+    return v; 
+  }
+  
+  /* Single Expression */
+  if (v->count == 1) 
+  {
+    return lval_take(v, 0); 
+  }
+  
+  /* Ensure First Element is Symbol */
+  if (v->cell[0]->type != LVAL_SYM) 
+  {
+    lval_del(v);
+    return lval_err("S-expression Does not start with symbol.");
+  }
+  
+  /* Call builtin with operator, the operands stay in place */
+  return builtin_op(v, v->cell[0]->op);
+}
+
+/* This function takes in an lval of type v and checks if the 
+ * type is LVAL_SEXPR, if it is it passes it to the function
+ * lval_eval_sexpr() and returns the other types as it is.
+ *
+ * This is the original recursive evaluator. Every level of nesting costs
+ * a C stack frame, so it is only kept around as the baseline for --bench,
+ * lval_eval() below is what everything else uses.
+ */
+
+lval* lval_eval_recursive(lval* v) 
+{
+  /* Evaluate Sexpressions, evaluating changes them so they can't be shared */
+  if (v->type == LVAL_SEXPR) 
+  {
+    return lval_eval_sexpr(lval_unshare(v)); 
+  }
+  /* All other lval types remain the same */
+  return v;
+}
+
+/* This is the explicit stack evaluator behind lval_eval().
+ * Instead of recursing, every S-expression being evaluated gets a frame
+ * on a heap allocated stack holding the expression and the index of the
+ * child to evaluate next. The top frame either pushes its next child,
+ * if that is an S-expression, or once all children are done applies the
+ * builtin and hands the result to the frame below. Children that evaluate
+ * to themselves are skipped without a frame.
+ *
+ * The stack is thread local and kept between calls, so the frames in use
+ * stay in cache. Nesting is limited only by eval_budget, the most bytes
+ * the stack may grow to, set with --eval-budget in MiB. --vm and --fold
+ * check the same limit up front with eval_fits().
+ *
+ * The first EVAL_RECURSE_DEPTH levels are evaluated by plain recursion,
+ * which is cheaper per node than a frame, and only deeper subtrees go on
+ * the explicit stack. That one is told how many levels are above it, so
+ * the budget runs out at exactly the same nesting either way.
+ */
+
+#define EVAL_RECURSE_DEPTH 32
+
+typedef struct eval_frame
+{
+  lval* v;
+  int i;
+} eval_frame;
+
+typedef struct eval_stack
+{
+  eval_frame* frames;
+  int depth;
+  int cap;
+} eval_stack;
+
+static _Thread_local eval_stack eval_frames;
+static size_t eval_budget = (size_t)64 << 20;
+
+/* Makes room for one more frame, 0 when that would go over the budget */
+int eval_grow(eval_stack* s)
+{
+  if ((size_t)(s->depth + 1) * sizeof(eval_frame) > eval_budget)
+  {
+    return 0;
+  }
+  size_t cap = s->cap ? (size_t)s->cap * 2 : 64;
+  if (cap * sizeof(eval_frame) > eval_budget)
+  {
+    cap = eval_budget / sizeof(eval_frame);
+  }
+  eval_frame* frames = realloc(s->frames, cap * sizeof(eval_frame));
+  if (frames == NULL)
+  {
+    return 0;
+  }
+  s->frames = frames;
+  s->cap = (int)cap;
+  return 1;
+}
+
+/* The most frames eval_budget allows */
+int eval_budget_frames(void)
+{
+  size_t n = eval_budget / sizeof(eval_frame);
+  return n > INT_MAX ? INT_MAX : (int)n;
+}
+
+// Set when the budget ran out, the recursive levels above then give up
+// too instead of carrying on with the siblings.
+static _Thread_local int eval_aborted;
+
+/* Evaluates the S-expression v on the explicit stack, with above levels
+ * of nesting already taken up by the recursive evaluator.
+ */
+lval* lval_eval_stack(lval* v, int above)
+{
+  /* Work on a local copy of the stack, frames below base belong to
+   * whoever called us.
+   */
+  eval_stack* s = &eval_frames;
+  eval_frame* frames = s->frames;
+  int base = s->depth;
+  int depth = base;
+  int cap = s->cap;
+  int limit = base + eval_budget_frames() - above;
+  lval* x = lval_unshare(v);
+  int i = 0;
+
+  while (1)
+  {
+    /* Evaluate child i */
+    while (i < x->count && x->cell[i]->type != LVAL_SEXPR)
+    {
+      i++;
+    }
+    if (i < x->count)
+    {
+      /* A child with no S-expressions under it is applied right away,
+       * which saves a push and a pop for the leaves of the tree. Either
+       * way it is about to change, so it can't stay shared.
+       */
+      lval* c = lval_unshare(x->cell[i]);
+      x->cell[i] = c;
+      int k = 0;
+      while (k < c->count && c->cell[k]->type != LVAL_SEXPR)
+      {
+        k++;
+      }
+      if (k == c->count)
+      {
+        x->cell[i++] = lval_sexpr_apply(c);
+        continue;
+      }
+
+      if (depth == cap || depth >= limit)
+      {
+        s->depth = depth;
+        if (depth >= limit || !eval_grow(s))
+        {
+          /* Half evaluated children are still in place, one delete does */
+          lval_del(depth > base ? frames[base].v : x);
+          s->depth = base;
+          eval_aborted = 1;
+          return lval_err("Nesting exceeds the evaluation budget.");
+        }
+        frames = s->frames;
+        cap = s->cap;
+      }
+      frames[depth++] = (eval_frame){ x, i };
+      x = c;
+      i = k;
+      continue;
+    }
+
+    /* Apply builtin and pass the result down */
+    lval* r = lval_sexpr_apply(x);
+    if (depth == base)
+    {
+      s->depth = base;
+      return r;
+    }
+    depth--;
+    x = frames[depth].v;
+    i = frames[depth].i;
+    x->cell[i++] = r;
+  }
+}
+
+/* Evaluates the S-expression v, depth levels down, by recursion */
+lval* lval_eval_shallow(lval* v, int depth)
+{
+  lval* x = lval_unshare(v);
+  for (int i = 0; i < x->count; i++)
+  {
+    lval* c = x->cell[i];
+    if (c->type != LVAL_SEXPR)
+    {
+      continue;
+    }
+    lval* r = depth + 1 < EVAL_RECURSE_DEPTH
+      ? lval_eval_shallow(c, depth + 1) : lval_eval_stack(c, depth + 1);
+    x->cell[i] = r;
+    if (r->type == LVAL_ERR && eval_aborted)
+    {
+      return lval_take(x, i);
+    }
+  }
+  return lval_sexpr_apply(x);
+}
+
+lval* lval_eval(lval* v)
+{
+  if (v->type != LVAL_SEXPR)
+  {
+    return v;
+  }
+  /* A budget too small for the recursive levels goes to the stack */
+  if (eval_budget_frames() < EVAL_RECURSE_DEPTH)
+  {
+    lval* r = lval_eval_stack(v, 0);
+    eval_aborted = 0;
+    return r;
+  }
+  lval* r = lval_eval_shallow(v, 0);
+  eval_aborted = 0;
+  return r;
+}
+
+/* Whether lval_eval() can evaluate v within eval_budget. It keeps a frame
+ * for every S-expression on the way down to one whose children still
+ * hold S-expressions, so an S-expression nested d deep needs d - 1.
+ */
+int eval_fits(lval* v)
+{
+  if (v->type != LVAL_SEXPR)
+  {
+    return 1;
+  }
+  size_t limit = eval_budget / sizeof(eval_frame);
+  int base = walk.depth;
+  walk_push(v, NULL);
+  while (walk.depth > base)
+  {
+    walk_frame* f = &walk.frames[walk.depth - 1];
+    if (f->i == f->v->count)
+    {
+      walk.depth--;
+      continue;
+    }
+    lval* c = f->v->cell[f->i++];
+    if (c->type != LVAL_SEXPR)
+    {
+      continue;
+    }
+    if ((size_t)(walk.depth - base - 1) > limit)
+    {
+      walk.depth = base;
+      return 0;
+    }
+    if (c->count > 0)
+    {
+      walk_push(c, NULL);
+    }
+  }
+  return 1;
+}
+
+/* Wraps a double just read with errno cleared beforehand. strtod() sets
+ * ERANGE for subnormal results too, and those are what the writer prints
+ * for the smallest numbers, so only overflow and underflow to zero are
+ * errors.
+ */
+
+lval* lval_num_read(double x)
+{
+  if (errno == ERANGE && (isinf(x) || x == 0.0))
+  {
+    return lval_err("invalid number");
+  }
+  return lval_num(x);
+}
+
+/* This function is called from lval_read() to convert a number which is
+ * of the string datatype into a float. It checks if there was any error 
+ * during the conversion, and according to that it checks 
+ */
+
+lval* lval_read_num(mpc_ast_t* t) 
+{
+  errno = 0;
+  double x = atof(t->contents);
+  return lval_num_read(x);
+}
+
+/* Converts the digits in [p, e), with a leading minus, into a Bignum.
+ * Each limb is simply the next 9 digits counting from the end.
+ */
+
+lval* lval_big_parse(char* p, char* e)
+{
+  bigint b;
+  b.neg = *p == '-';
+  p += b.neg;
+  while (p < e && *p == '0')
+  {
+    p++;
+  }
+  b.n = (int)((e - p + BIG_DIGITS - 1) / BIG_DIGITS);
+  b.d = big_new(b.n);
+  for (int i = 0; i < b.n; i++)
+  {
+    char* end = e - (ptrdiff_t)i * BIG_DIGITS;
+    char* c = end - BIG_DIGITS < p ? p : end - BIG_DIGITS;
+    uint32_t x = 0;
+    for (; c < end; c++)
+    {
+      x = x * 10 + (*c - '0');
+    }
+    b.d[i] = x;
+  }
+  return lval_big(&b);
+}
+
+/* Converts the digits in [p, e), with an optional leading minus, into an
+ * Integer. The value is built up negated so INT64_MIN, whose magnitude
+ * doesn't fit, can still be read. Anything out of range is a Bignum.
+ */
+
+lval* lval_int_parse(char* p, char* e)
+{
+  int neg = p < e && *p == '-';
+  int64_t x = 0;
+  for (char* c = p + neg; c < e; c++)
+  {
+    int d = *c - '0';
+    if (x < (INT64_MIN + d) / 10)
+    {
+      return lval_big_parse(p, e);
+    }
+    x = x * 10 - d;
+  }
+  if (!neg)
+  {
+    if (x == INT64_MIN)
+    {
+      return lval_big_parse(p, e);
+    }
+    x = -x;
+  }
+  return lval_int(x);
+}
+
+lval* lval_read_int(mpc_ast_t* t)
+{
+  return lval_int_parse(t->contents, t->contents + strlen(t->contents));
+}
+
+
+/* this function adds one more additional cell, or in other words it
+ * adds another pointer to the list of pointers and stores the Pointer
  * to the passed lval in it.
  */
 
-lval* lval_add(lval* v, lval* x) 
+lval* lval_add(lval* v, lval* x) 
+{
+  // A shared list is copied first, callers carry on with the result.
+  v = lval_unshare(v);
+
+  // A packed list only stays packed while numbers go into it.
+  if ((v->flags & LVAL_F_PACKED) && x->type != LVAL_NUM)
+  {
+    lval_unpack(v);
+  }
+
+  // Doubling the capacity when the list is full, so reading
+  // n elements only reallocates O(log n) times.
+  if (v->count == lval_cap(v))
+  {
+    lval_recap(v, v->count < 4 ? 4 : v->count * 2);
+  }
+
+  // Increasing the count 
+  v->count++;
+
+  // Packed lists just keep the number itself.
+  if (v->flags & LVAL_F_PACKED)
+  {
+    v->nums[v->count-1] = x->num;
+    lval_del(x);
+    return v;
+  }
+
+  // assigning the last cell to the new lval type.
+  v->cell[v->count-1] = x;
+  return v;
+}
+
+/* Makes a copy of v. It is just another reference, copy on write keeps
+ * the two apart once either is changed.
+ */
+
+lval* lval_copy(lval* v)
+{
+  return lval_ref(v);
+}
+
+/* Copies v on its own, a list gets its own cell array pointing at the
+ * same children as v. Packed lists have no children and are copied whole.
+ */
+
+lval* lval_copy_node(lval* v)
+{
+  switch (v->type)
+  {
+    case LVAL_NUM: return lval_num(v->num);
+    case LVAL_INT: return lval_int(v->inum);
+    case LVAL_BIG:
+    {
+      bigint b, c;
+      lval_big_view(v, &b);
+      big_copy(&c, &b);
+      return lval_big(&c);
+    }
+    case LVAL_ERR: return lval_err(v->err);
+    case LVAL_SYM: return lval_sym(v->sym);
+  }
+
+  lval* x = v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+  x->flags = (x->flags & ~LVAL_F_PACKED) | (v->flags & LVAL_F_PACKED);
+  lval_reserve(x, v->count);
+  if (v->count > 0)
+  {
+    memcpy(x->cell, v->cell, (v->flags & LVAL_F_PACKED)
+      ? sizeof(double) * v->count : sizeof(lval*) * v->count);
+  }
+  x->count = v->count;
+  return x;
+}
+
+/* Makes a deep copy of v, allocated the same way as a freshly read
+ * value would be. This is what lval_copy() used to do, it is only kept
+ * as the baseline for --bench. The lists whose children are still being
+ * copied wait on the walk stack, so deep nesting doesn't use up the C
+ * stack.
+ */
+
+lval* lval_deep_copy(lval* v)
+{
+  lval* x = lval_copy_node(v);
+  if (!lval_has_cells(x))
+  {
+    return x;
+  }
+
+  int base = walk.depth;
+  walk_push(x, NULL);
+  while (walk.depth > base)
+  {
+    walk_frame* f = &walk.frames[walk.depth - 1];
+    if (f->i == f->v->count)
+    {
+      walk.depth--;
+      continue;
+    }
+
+    lval* c = lval_copy_node(f->v->cell[f->i]);
+    f->v->cell[f->i++] = c;
+    if (lval_has_cells(c))
+    {
+      walk_push(c, NULL);
+    }
+  }
+  return x;
+}
+
+/* Compares a and b without looking into boxed children. Numbers are
+ * compared bit for bit, so two NaNs with the same payload are equal. A
+ * packed list is compared in full, against a boxed one too.
+ */
+
+int lval_equal_node(lval* a, lval* b)
+{
+  if (a->type != b->type)
+  {
+    return 0;
+  }
+  switch (a->type)
+  {
+    case LVAL_NUM: return memcmp(&a->num, &b->num, sizeof(double)) == 0;
+    case LVAL_INT: return a->inum == b->inum;
+    case LVAL_BIG:
+      return (a->flags & LVAL_F_NEG) == (b->flags & LVAL_F_NEG)
+        && big_cmp(a->limbs, a->count, b->limbs, b->count) == 0;
+    case LVAL_ERR: return strcmp(a->err, b->err) == 0;
+    case LVAL_SYM: return a->sym == b->sym;
+  }
+  if (a->count != b->count)
+  {
+    return 0;
+  }
+
+  /* A packed list equals a boxed one holding the same numbers */
+  int ap = a->flags & LVAL_F_PACKED;
+  int bp = b->flags & LVAL_F_PACKED;
+  if (!ap && !bp)
+  {
+    return 1;
+  }
+  for (int i = 0; i < a->count; i++)
+  {
+    if ((!ap && a->cell[i]->type != LVAL_NUM)
+      || (!bp && b->cell[i]->type != LVAL_NUM))
+    {
+      return 0;
+    }
+    double x = ap ? a->nums[i] : a->cell[i]->num;
+    double y = bp ? b->nums[i] : b->cell[i]->num;
+    if (memcmp(&x, &y, sizeof(double)) != 0)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Returns 1 if a and b are structurally the same value. The two lists
+ * being compared are pushed on the walk stack together, a's frame below
+ * b's, and a's frame holds the index of the next pair of children.
+ */
+
+int lval_equal(lval* a, lval* b)
+{
+  if (!lval_equal_node(a, b))
+  {
+    return 0;
+  }
+  if (!lval_has_cells(a) || !lval_has_cells(b))
+  {
+    return 1;
+  }
+
+  int base = walk.depth;
+  walk_push(a, NULL);
+  walk_push(b, NULL);
+  while (walk.depth > base)
+  {
+    walk_frame* f = &walk.frames[walk.depth - 2];
+    if (f->i == f->v->count)
+    {
+      walk.depth -= 2;
+      continue;
+    }
+
+    int i = f->i++;
+    lval* x = f->v->cell[i];
+    lval* y = walk.frames[walk.depth - 1].v->cell[i];
+    /* Shared children are equal without looking */
+    if (x == y)
+    {
+      continue;
+    }
+    if (!lval_equal_node(x, y))
+    {
+      walk.depth = base;
+      return 0;
+    }
+    if (lval_has_cells(x) && lval_has_cells(y))
+    {
+      walk_push(x, NULL);
+      walk_push(y, NULL);
+    }
+  }
+  return 1;
+}
+
+/* Reads a number or symbol node, NULL for anything else */
+lval* lval_read_atom(mpc_ast_t* t)
+{
+  if (strstr(t->tag, "number"))
+  {
+    return lval_read_num(t); 
+  }
+  if (strstr(t->tag, "integer"))
+  {
+    return lval_read_int(t); 
+  }
+  if (strstr(t->tag, "symbol"))
+  {
+    return lval_sym(t->contents); 
+  }
+  return NULL;
+}
+
+/* If root (>) or sexpr then create an empty list, with room for all the
+ * children of the branch.
+ */
+
+lval* lval_read_list(mpc_ast_t* t)
+{
+  lval* x = NULL;
+  if (strcmp(t->tag, ">") == 0)
+  {
+    x = lval_sexpr(); 
+  } 
+  if (strstr(t->tag, "sexpr"))
+  {
+    x = lval_sexpr(); 
+  }
+  if (strstr(t->tag, "qexpr"))
+  {
+    x = lval_qexpr();
+  }
+  lval_reserve(x, t->children_num);
+  return x;
+}
+
+/* Brackets and the regex anchors around the root aren't expressions */
+int lval_read_skip(mpc_ast_t* t)
+{
+  return strcmp(t->contents, "(") == 0 || strcmp(t->contents, ")") == 0
+    || strcmp(t->contents, "{") == 0 || strcmp(t->contents, "}") == 0
+    || strcmp(t->tag, "regex") == 0;
+}
+
+/* This function takes in an abstract syntax tree and converts it into s-expressions
+ * by ckecking the tag of the branch. It then determines the type and constructs 
+ * lvals related to those tags, if the tag contains ">" or "sexpr" then it creates 
+ * an empty sexpr type lval. It then loops through all the children of the branch
+ * and adds them to the sexpr by using the lval_add() function, a branch inside it
+ * gets a frame on the walk stack and is added to its parent once it is complete.
+ * It returns an lval of the type x which effectively contains all the input that
+ * the user typed.
+ */
+
+lval* lval_read(mpc_ast_t* t) 
+{
+  lval* x = lval_read_atom(t);
+  if (x != NULL)
+  {
+    return x;
+  }
+
+  int base = walk.depth;
+  walk_push(lval_read_list(t), t);
+  while (1)
+  {
+    walk_frame* f = &walk.frames[walk.depth - 1];
+
+    /* Fill this list with any valid expression contained within */
+    if (f->i < f->t->children_num)
+    {
+      mpc_ast_t* c = f->t->children[f->i++];
+      if (lval_read_skip(c))
+      {
+        continue;
+      }
+      lval* y = lval_read_atom(c);
+      if (y != NULL)
+      {
+        f->v = lval_add(f->v, y);
+      }
+      else
+      {
+        walk_push(lval_read_list(c), c);
+      }
+      continue;
+    }
+
+    /* Complete, hand it to the parent */
+    x = f->v;
+    walk.depth--;
+    if (walk.depth == base)
+    {
+      return x;
+    }
+    f = &walk.frames[walk.depth - 1];
+    f->v = lval_add(f->v, x);
+  }
+}
+
+/* This is the native reader, used unless lispy is started with --mpc.
+ * Rather than building an mpc_ast_t and walking it with lval_read(), it
+ * scans the input once and builds lvals directly. Symbols are interned
+ * straight from the input buffer and numbers are converted where they
+ * sit, so nothing is copied. It accepts the same language as the mpc
+ * grammar in main. Open lists are kept on an explicit stack instead of
+ * the C stack, so deeply nested input can't overflow it.
+ */
+
+typedef struct reader
+{
+  // Name of the input, used in error messages.
+  char* name;
+
+  // The input buffer, it doesn't need to be null terminated.
+  char* start;
+  char* end;
+
+  // Where the next expression starts.
+  char* pos;
+
+  // Stack of lists that are still open, the bottom one is outermost.
+  lval** stack;
+  int depth;
+  int cap;
+
+  char error[256];
+} reader;
+
+/* Records a parse error at p in the style of mpc_err_print() */
+void reader_error(reader* r, char* p, char* msg)
+{
+  int line = 1, col = 1;
+  for (char* c = r->start; c < p; c++)
+  {
+    if (*c == '\n') { line++; col = 1; } else { col++; }
+  }
+  snprintf(r->error, sizeof(r->error), "%s:%d:%d: error: %s",
+    r->name, line, col, msg);
+}
+
+/* Returns the end of the number starting at p, which must look like
+ * /-?[0-9]+.[0-9]+/ or for an Integer /-?[0-9]+/, or NULL if there isn't
+ * one.
+ */
+
+char* reader_number_end(reader* r, char* p)
+{
+  if (p < r->end && *p == '-') { p++; }
+  char* digits = p;
+  while (p < r->end && isdigit((unsigned char)*p)) { p++; }
+  if (p == digits) { return NULL; }
+  if (p >= r->end || *p != '.') { return p; }
+  p++;
+  digits = p;
+  while (p < r->end && isdigit((unsigned char)*p)) { p++; }
+  if (p == digits) { return NULL; }
+
+  /* Optional exponent, the way big and small numbers are printed */
+  char* e = p;
+  if (p < r->end && (*p == 'e' || *p == 'E'))
+  {
+    p++;
+    if (p < r->end && (*p == '-' || *p == '+')) { p++; }
+    digits = p;
+    while (p < r->end && isdigit((unsigned char)*p)) { p++; }
+    if (p == digits) { return e; }
+  }
+  return p;
+}
+
+/* Converts the number token [p, e) in place. Integers go through
+ * lval_int_parse(). For doubles strtod needs a terminator after the
+ * token, which is only missing when the token runs right up to the end
+ * of the buffer, in which case it is copied first.
+ */
+
+lval* reader_number(reader* r, char* p, char* e)
+{
+  if (memchr(p, '.', e - p) == NULL)
+  {
+    return lval_int_parse(p, e);
+  }
+  errno = 0;
+  double x;
+  if (e < r->end)
+  {
+    x = strtod(p, NULL);
+  }
+  else
+  {
+    char* tmp = malloc(e - p + 1);
+    memcpy(tmp, p, e - p);
+    tmp[e - p] = '\0';
+    x = strtod(tmp, NULL);
+    free(tmp);
+  }
+  return lval_num_read(x);
+}
+
+void reader_push(reader* r, lval* x)
+{
+  if (r->depth == r->cap)
+  {
+    r->cap = r->cap ? r->cap * 2 : 32;
+    r->stack = realloc(r->stack, sizeof(lval*) * r->cap);
+  }
+  r->stack[r->depth++] = x;
+}
+
+/* Reads the next top level expression starting at r->pos and moves
+ * r->pos past it. Returns NULL at the end of the input, or with r->error
+ * filled if the input doesn't parse.
+ */
+
+lval* reader_next(reader* r)
+{
+  char* p = r->pos;
+  r->depth = 0;
+  lval* x = NULL;
+
+  while (1)
+  {
+    /* Skip whitespace */
+    while (p < r->end && isspace((unsigned char)*p)) { p++; }
+    if (p == r->end)
+    {
+      break;
+    }
+
+    lval* top = r->depth > 0 ? r->stack[r->depth-1] : NULL;
+    char c = *p;
+
+    /* Open a new list, it is added to its parent straight away so that
+     * deleting the outermost one on an error deletes everything.
+     */
+    if (c == '(' || c == '{')
+    {
+      x = c == '(' ? lval_sexpr() : lval_qexpr();
+      if (top != NULL)
+      {
+        r->stack[r->depth-1] = lval_add(top, x);
+      }
+      reader_push(r, x);
+      p++;
+      continue;
+    }
+
+    /* Close the innermost list */
+    if (c == ')' || c == '}')
+    {
+      int type = c == ')' ? LVAL_SEXPR : LVAL_QEXPR;
+      if (top == NULL || top->type != type)
+      {
+        reader_error(r, p, top == NULL ? "unexpected closing bracket"
+          : (top->type == LVAL_SEXPR ? "expected ')'" : "expected '}'"));
+        break;
+      }
+      r->depth--;
+      p++;
+      if (r->depth == 0)
+      {
+        r->pos = p;
+        return top;
+      }
+      continue;
+    }
+
+    /* Numbers are tried before symbols, so -1.0 is a number */
+    char* e = reader_number_end(r, p);
+    x = NULL;
+    if (e != NULL)
+    {
+      x = reader_number(r, p, e);
+    }
+    else if (c != '\0' && strchr("+-*/%^", c) != NULL)
+    {
+      x = lval_sym_n(p, 1);
+      e = p + 1;
+    }
+    else
+    {
+      reader_error(r, p, "expected number, symbol, '(' or '{'");
+      break;
+    }
+
+    p = e;
+    if (top == NULL)
+    {
+      r->pos = p;
+      return x;
+    }
+    r->stack[r->depth-1] = lval_add(top, x);
+  }
+
+  if (r->depth > 0 && r->error[0] == '\0')
+  {
+    reader_error(r, p, r->stack[r->depth-1]->type == LVAL_SEXPR
+      ? "expected ')' at end of input" : "expected '}' at end of input");
+  }
+  if (r->depth > 0)
+  {
+    lval_del(r->stack[0]);
+  }
+  r->pos = p;
+  return NULL;
+}
+
+/* Reads every expression in [start, end) into a single S-expression,
+ * the same shape lval_read() gives for the root of an mpc AST. Returns
+ * NULL and fills r->error if the input doesn't parse.
+ */
+
+lval* reader_read(reader* r)
+{
+  lval* root = lval_sexpr();
+  lval* x;
+  r->pos = r->start;
+  while ((x = reader_next(r)) != NULL)
+  {
+    root = lval_add(root, x);
+  }
+  if (r->error[0] != '\0')
+  {
+    lval_del(root);
+    return NULL;
+  }
+  return root;
+}
+
+/* Reads the n bytes at s, see reader_read() */
+lval* lval_read_str(char* name, char* s, size_t n, char* error, size_t error_size)
+{
+  reader r = { .name = name, .start = s, .end = s + n };
+  lval* x = reader_read(&r);
+  if (x == NULL)
+  {
+    snprintf(error, error_size, "%s", r.error);
+  }
+  free(r.stack);
+  return x;
+}
+
+/* This is the bytecode compiler and stack VM, used with --vm.
+ * lval_compile() lowers a read tree into a flat lprog once, and
+ * lprog_run() can then evaluate it any number of times without touching
+ * the tree or the allocator, only the final result is turned back into
+ * an lval. The tree walking lval_eval() stays the reference, --vm-check
+ * runs both and complains if they ever disagree.
+ *
+ * Since evaluation has no side effects the VM stops at the first error in
+ * an expression, which is the same error lval_eval_sexpr() would return
+ * after evaluating all of the children.
+ */
+
+enum
+{
+  OP_NUM,     /* push nums[arg] */
+  OP_INT,     /* push the Integer consts[arg] */
+  OP_CONST,   /* push consts[arg], a Symbol, Q-expression or Bignum */
+  OP_ERR,     /* push the error in consts[arg] */
+  OP_REDUCE,  /* apply opcode arg to the top n values, n is the next word */
+  OP_APPLY,   /* evaluate an S-expression of arg values whose head is dynamic */
+};
+
+/* A VM_TEMP is an lval the VM made itself, like the result of adding
+ * two packed lists, which it owns and frees once it has been consumed.
+ */
+
+enum { VM_NUM, VM_REF, VM_ERR, VM_TEMP, VM_INT };
+
+typedef struct vmval
+{
+  int kind;
+  union
+  {
+    double num;
+    int64_t inum;
+    lval* ref;
+    char* err;
+  };
+} vmval;
+
+typedef struct lprog
+{
+  int* code;
+  int count;
+  int cap;
+
+  double* nums;
+  int nnums;
+  int capnums;
+
+  // Values the program refers to, owned by the program.
+  lval** consts;
+  int nconsts;
+  int capconsts;
+
+  // Stack depth while compiling, and the deepest it ever gets.
+  int depth;
+  int max_depth;
+
+  // Value stack, allocated once so running doesn't malloc.
+  vmval* stack;
+} lprog;
+
+void lprog_emit(lprog* p, int x)
+{
+  if (p->count == p->cap)
+  {
+    p->cap = p->cap ? p->cap * 2 : 64;
+    p->code = realloc(p->code, sizeof(int) * p->cap);
+  }
+  p->code[p->count++] = x;
+}
+
+/* Records that the program pushes (or with a negative n pops) n values */
+void lprog_depth(lprog* p, int n)
+{
+  p->depth += n;
+  if (p->depth > p->max_depth)
+  {
+    p->max_depth = p->depth;
+  }
+}
+
+int lprog_num(lprog* p, double x)
+{
+  if (p->nnums == p->capnums)
+  {
+    p->capnums = p->capnums ? p->capnums * 2 : 16;
+    p->nums = realloc(p->nums, sizeof(double) * p->capnums);
+  }
+  p->nums[p->nnums] = x;
+  return p->nnums++;
+}
+
+int lprog_const(lprog* p, lval* v)
+{
+  if (p->nconsts == p->capconsts)
+  {
+    p->capconsts = p->capconsts ? p->capconsts * 2 : 16;
+    p->consts = realloc(p->consts, sizeof(lval*) * p->capconsts);
+  }
+  p->consts[p->nconsts] = lval_copy(v);
+  return p->nconsts++;
+}
+
+/* Emits code that pushes v, which is not an S-expression with children */
+void lprog_compile_leaf(lprog* p, lval* v)
+{
+  switch (v->type)
+  {
+    case LVAL_NUM:
+      lprog_emit(p, OP_NUM);
+      lprog_emit(p, lprog_num(p, v->num));
+      break;
+    case LVAL_INT:
+      lprog_emit(p, OP_INT);
+      lprog_emit(p, lprog_const(p, v));
+      break;
+    case LVAL_ERR:
+      lprog_emit(p, OP_ERR);
+      lprog_emit(p, lprog_const(p, v));
+      break;
+    default:
+      /* Symbols, Q-expressions, Bignums and the empty S-expression,
+       * which evaluates to itself
+       */
+      lprog_emit(p, OP_CONST);
+      lprog_emit(p, lprog_const(p, v));
+      break;
+  }
+  lprog_depth(p, 1);
+}
+
+/* Emits the code that applies v once all of its children are pushed */
+void lprog_compile_apply(lprog* p, lval* v)
+{
+  /* The common case, a literal operator, is resolved right here */
+  if (v->cell[0]->type == LVAL_SYM)
+  {
+    lprog_emit(p, OP_REDUCE);
+    lprog_emit(p, v->cell[0]->op);
+    lprog_emit(p, v->count - 1);
+    lprog_depth(p, -(v->count - 2));
+    return;
+  }
+
+  lprog_emit(p, OP_APPLY);
+  lprog_emit(p, v->count);
+  lprog_depth(p, -(v->count - 1));
+}
+
+/* Emits code that leaves the value of v on top of the stack. The
+ * S-expressions being compiled are kept on the walk stack, so deep
+ * nesting doesn't use up the C stack.
+ */
+
+void lprog_compile_expr(lprog* p, lval* v)
+{
+  int base = walk.depth;
+  while (v != NULL)
+  {
+    /* A single S-expression evaluates to its child */
+    while (v->type == LVAL_SEXPR && v->count == 1)
+    {
+      v = v->cell[0];
+    }
+
+    if (v->type != LVAL_SEXPR || v->count == 0)
+    {
+      lprog_compile_leaf(p, v);
+    }
+    else
+    {
+      /* A literal operator isn't pushed, the reduction names it */
+      walk_push(v, NULL);
+      walk.frames[walk.depth - 1].i = v->cell[0]->type == LVAL_SYM;
+    }
+
+    /* Move on to the next child, applying the lists that are done */
+    v = NULL;
+    while (walk.depth > base)
+    {
+      walk_frame* f = &walk.frames[walk.depth - 1];
+      if (f->i < f->v->count)
+      {
+        v = f->v->cell[f->i++];
+        break;
+      }
+      walk.depth--;
+      lprog_compile_apply(p, f->v);
+    }
+  }
+}
+
+/* Compiles v into a new program, v itself is left untouched */
+lprog* lval_compile(lval* v)
+{
+  lprog* p = calloc(1, sizeof(lprog));
+  lprog_compile_expr(p, v);
+  p->stack = malloc(sizeof(vmval) * p->max_depth);
+  return p;
+}
+
+void lprog_del(lprog* p)
+{
+  for (int i = 0; i < p->nconsts; i++)
+  {
+    lval_del(p->consts[i]);
+  }
+  free(p->consts);
+  free(p->nums);
+  free(p->code);
+  free(p->stack);
+  free(p);
+}
+
+/* Frees the temporaries among n consumed values */
+void vm_release(vmval* args, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    if (args[i].kind == VM_TEMP)
+    {
+      lval_del(args[i].ref);
+    }
+  }
+}
+
+/* Element-wise version of vm_reduce() for packed lists of doubles. The
+ * accumulator is always a fresh copy, the first operand may be one of
+ * the program's constants.
+ */
+vmval vm_reduce_vec(int op, vmval* args, int n)
+{
+  vmval x = { .kind = VM_TEMP };
+  lval* acc = lval_clone(args[0].ref);
+  lval** rest = malloc(sizeof(lval*) * n);
+  for (int i = 1; i < n; i++)
+  {
+    rest[i-1] = args[i].ref;
+  }
+  char* err = lvec_reduce(op, acc, rest, n - 1);
+  free(rest);
+
+  if (err != NULL)
+  {
+    lval_del(acc);
+    x.kind = VM_ERR;
+    x.err = err;
+    return x;
+  }
+  x.ref = acc;
+  return x;
+}
+
+vmval vm_reduce(int op, vmval* args, int n);
+
+/* Element-wise version of vm_reduce() for lists of numbers that aren't
+ * all packed doubles, one element at a time through vm_reduce() itself,
+ * the same way builtin_vec() goes through builtin_op().
+ */
+vmval vm_reduce_elems(int op, vmval* args, int n)
+{
+  vmval x = { .kind = VM_ERR };
+  int len = args[0].ref->count;
+  for (int i = 1; i < n; i++)
+  {
+    if (args[i].ref->count != len)
+    {
+      x.err = "Vector length mismatch.";
+      return x;
+    }
+  }
+
+  lval* acc = lval_qexpr();
+  vmval* elems = malloc(sizeof(vmval) * n);
+  for (int j = 0; j < len; j++)
+  {
+    for (int i = 0; i < n; i++)
+    {
+      lval* v = args[i].ref;
+      lval* c = (v->flags & LVAL_F_PACKED) ? NULL : v->cell[j];
+      if (c == NULL || c->type == LVAL_NUM)
+      {
+        elems[i].kind = VM_NUM;
+        elems[i].num = c == NULL ? v->nums[j] : c->num;
+      }
+      else if (c->type == LVAL_INT)
+      {
+        elems[i].kind = VM_INT;
+        elems[i].inum = c->inum;
+      }
+      else
+      {
+        elems[i].kind = VM_REF;
+        elems[i].ref = c;
+      }
+    }
+
+    vmval r = vm_reduce(op, elems, n);
+    vm_release(elems, n);
+    if (r.kind == VM_ERR)
+    {
+      free(elems);
+      lval_del(acc);
+      return r;
+    }
+    lval* y = r.kind == VM_NUM ? lval_num(r.num)
+      : r.kind == VM_INT ? lval_int(r.inum)
+      : r.kind == VM_TEMP ? r.ref : lval_ref(r.ref);
+    acc = lval_add(acc, y);
+  }
+  free(elems);
+
+  x.kind = VM_TEMP;
+  x.ref = acc;
+  return x;
+}
+
+/* Turns a number on the stack into a VM_NUM, freeing it if it was a
+ * Bignum the VM made itself.
+ */
+void vm_to_double(vmval* v)
+{
+  if (v->kind == VM_INT)
+  {
+    v->num = (double)v->inum;
+  }
+  else if (v->kind == VM_REF || v->kind == VM_TEMP)
+  {
+    bigint b;
+    lval_big_view(v->ref, &b);
+    double x = big_to_double(&b);
+    if (v->kind == VM_TEMP)
+    {
+      lval_del(v->ref);
+    }
+    v->num = x;
+  }
+  v->kind = VM_NUM;
+}
+
+/* Bignum version of vm_reduce(), mirroring builtin_big(). Results that
+ * are Bignums are VM_TEMPs.
+ */
+
+vmval vm_reduce_big(int op, vmval* args, int n)
+{
+  vmval x = { .kind = VM_ERR };
+  if (op == LOP_NONE)
+  {
+    x.err = "Unknown operator.";
+    return x;
+  }
+
+  bigint* xs = malloc(sizeof(bigint) * n);
+  for (int i = 0; i < n; i++)
+  {
+    if (args[i].kind == VM_INT)
+    {
+      big_from_int(&xs[i], args[i].inum);
+    }
+    else
+    {
+      lval_big_view(args[i].ref, &xs[i]);
+    }
+  }
+  bigint acc;
+  int at;
+  int r = big_reduce(op, &acc, xs, n, &at);
+  free(xs);
+
+  if (r < 0 || r == 2)
+  {
+    big_free(&acc);
+    x.err = lint_error(op, r);
+    return x;
+  }
+  if (r > 0)
+  {
+    /* The accumulator takes the slot of the last operand it used */
+    double d = big_to_double(&acc);
+    big_free(&acc);
+    for (int j = at - 1; j < n; j++)
+    {
+      vm_to_double(&args[j]);
+    }
+    args[at-1].num = d;
+    return vm_reduce(op, args + at - 1, n - at + 1);
+  }
+
+  int64_t i;
+  if (big_to_int(&acc, &i))
+  {
+    big_free(&acc);
+    x.kind = VM_INT;
+    x.inum = i;
+    return x;
+  }
+  x.kind = VM_TEMP;
+  x.ref = lval_big(&acc);
+  return x;
+}
+
+/* Integer version of vm_reduce(), mirroring builtin_int(). When a step
+ * overflows the accumulator takes the slot of the last operand used and
+ * vm_reduce_big() does the rest.
+ */
+
+vmval vm_reduce_int(int op, vmval* args, int n)
+{
+  vmval x = { .kind = VM_ERR };
+  if (op == LOP_NONE)
+  {
+    x.err = "Unknown operator.";
+    return x;
+  }
+
+  int64_t acc = args[0].inum;
+  int i = 1, r = 0;
+  if (op == LOP_SUB && n == 1)
+  {
+    r = lint_negate(&acc);
+  }
+  while (r == 0 && i < n)
+  {
+    r = lint_step(op, &acc, args[i].inum);
+    i += r == 0;
+  }
+  if (r < 0)
+  {
+    x.err = lint_error(op, r);
+    return x;
+  }
+  if (r > 0)
+  {
+    args[i-1].kind = VM_INT;
+    args[i-1].inum = acc;
+    return vm_reduce_big(op, args + i - 1, n - i + 1);
+  }
+
+  x.kind = VM_INT;
+  x.inum = acc;
+  return x;
+}
+
+/* Folds the n operands in args with opcode op, mirroring builtin_op().
+ * The operands are left for the caller to release.
+ */
+
+vmval vm_reduce(int op, vmval* args, int n)
+{
+  vmval x = { .kind = VM_ERR };
+
+  for (int i = 0; i < n; i++)
+  {
+    if (args[i].kind == VM_ERR)
+    {
+      return args[i];
+    }
+  }
+
+  int nums = 0, ints = 0, bigs = 0, vecs = 0, packed = 0;
+  for (int i = 0; i < n; i++)
+  {
+    nums += args[i].kind == VM_NUM;
+    ints += args[i].kind == VM_INT;
+    if (args[i].kind == VM_REF || args[i].kind == VM_TEMP)
+    {
+      bigs += args[i].ref->type == LVAL_BIG;
+      vecs += lval_is_vec(args[i].ref);
+      packed += (args[i].ref->flags & LVAL_F_PACKED) != 0;
+    }
+  }
+  if (vecs == n)
+  {
+    return packed == n ? vm_reduce_vec(op, args, n)
+      : vm_reduce_elems(op, args, n);
+  }
+  if (ints + bigs == n)
+  {
+    return bigs > 0 ? vm_reduce_big(op, args, n) : vm_reduce_int(op, args, n);
+  }
+  if (nums + ints + bigs != n)
+  {
+    x.err = "Cannot operator on non number!";
+    return x;
+  }
+  for (int i = 0; i < n && ints + bigs > 0; i++)
+  {
+    vm_to_double(&args[i]);
+  }
+
+  double acc = args[0].num;
+  double* xs;
+  switch (op)
+  {
+    case LOP_ADD:
+    case LOP_MUL:
+      /* Same summation order as builtin_add() and builtin_mul() */
+      xs = lreduce_buffer(n);
+      for (int i = 0; i < n; i++) { xs[i] = args[i].num; }
+      acc = lreduce(xs, n, op);
+      break;
+    case LOP_SUB:
+      if (n == 1) { acc = -acc; }
+      if (n - 1 >= SIMD_MIN)
+      {
+        xs = lreduce_buffer(n - 1);
+        for (int i = 1; i < n; i++) { xs[i-1] = args[i].num; }
+        acc -= lreduce(xs, n - 1, LOP_ADD);
+        break;
+      }
+      for (int i = 1; i < n; i++) { acc -= args[i].num; }
+      break;
+    case LOP_DIV:
+      for (int i = 1; i < n; i++)
+      {
+        if (args[i].num == 0)
+        {
+          x.err = "Division By Zero.";
+          return x;
+        }
+        acc /= args[i].num;
+      }
+      break;
+    case LOP_MOD:
+      for (int i = 1; i < n; i++) { acc = fmod(acc, args[i].num); }
+      break;
+    case LOP_POW:
+      for (int i = 1; i < n; i++) { acc = pow(acc, args[i].num); }
+      break;
+    default:
+      x.err = "Unknown operator.";
+      return x;
+  }
+
+  x.kind = VM_NUM;
+  x.num = acc;
+  return x;
+}
+
+/* Runs the program and returns its result as a new lval */
+lval* lprog_run(lprog* p)
+{
+  vmval* sp = p->stack;
+  int* pc = p->code;
+  int* end = p->code + p->count;
+
+  while (pc < end)
+  {
+    switch (*pc++)
+    {
+      case OP_NUM:
+        sp->kind = VM_NUM;
+        sp->num = p->nums[*pc++];
+        sp++;
+        break;
+      case OP_INT:
+        sp->kind = VM_INT;
+        sp->inum = p->consts[*pc++]->inum;
+        sp++;
+        break;
+      case OP_CONST:
+        sp->kind = VM_REF;
+        sp->ref = p->consts[*pc++];
+        sp++;
+        break;
+      case OP_ERR:
+        sp->kind = VM_ERR;
+        sp->err = p->consts[*pc++]->err;
+        sp++;
+        break;
+      case OP_REDUCE:
+      {
+        int op = *pc++;
+        int n = *pc++;
+        sp -= n;
+        vmval r = vm_reduce(op, sp, n);
+        vm_release(sp, n);
+        *sp++ = r;
+        break;
+      }
+      case OP_APPLY:
+      {
+        int n = *pc++;
+        sp -= n;
+
+        /* Same checks, in the same order, as lval_eval_sexpr() */
+        vmval r;
+        int i = 0;
+        while (i < n && sp[i].kind != VM_ERR)
+        {
+          i++;
+        }
+        if (i < n)
+        {
+          r = sp[i];
+        }
+        else if (sp[0].kind != VM_REF || sp[0].ref->type != LVAL_SYM)
+        {
+          r.kind = VM_ERR;
+          r.err = "S-expression Does not start with symbol.";
+        }
+        else
+        {
+          r = vm_reduce(sp[0].ref->op, sp + 1, n - 1);
+        }
+        vm_release(sp, n);
+        *sp++ = r;
+        break;
+      }
+    }
+  }
+
+  sp--;
+  switch (sp->kind)
+  {
+    case VM_NUM: return lval_num(sp->num);
+    case VM_INT: return lval_int(sp->inum);
+    case VM_ERR: return lval_err(sp->err);
+    case VM_TEMP: return sp->ref;
+  }
+  return lval_copy(sp->ref);
+}
+
+/* This is the constant folding pass, used with --fold. It runs between
+ * lval_read() and lval_eval() and replaces every S-expression that only
+ * applies a builtin operator to number literals with the resulting
+ * number, working bottom up so nested ones collapse too. An expression
+ * whose evaluation would give an error, like (/ 1.0 0.0), is left alone
+ * so the error still surfaces when it is evaluated. Q-expressions are
+ * data and are never looked into. The number of nodes removed is added
+ * to *eliminated.
+ */
+
+/* Folds the S-expression v, whose children have been folded already */
+lval* lval_fold_node(lval* v, long* eliminated)
+{
+  int numbers = 1;
+  for (int i = 1; i < v->count; i++)
+  {
+    if (!lval_is_number(v->cell[i]))
+    {
+      numbers = 0;
+    }
+  }
+
+  /* (x) evaluates to x */
+  if (v->count == 1 && lval_is_number(v->cell[0]))
+  {
+    *eliminated += 1;
+    return lval_take(v, 0);
+  }
+
+  if (v->count < 2 || !numbers || v->cell[0]->type != LVAL_SYM
+    || v->cell[0]->op == LOP_NONE)
+  {
+    return v;
+  }
+
+  /* Evaluate it with the VM's reduction, which only allocates for
+   * Bignums
+   */
+  int n = v->count - 1;
+  vmval* args = malloc(sizeof(vmval) * n);
+  for (int i = 0; i < n; i++)
+  {
+    lval* c = v->cell[i+1];
+    switch (c->type)
+    {
+      case LVAL_INT: args[i].kind = VM_INT; args[i].inum = c->inum; break;
+      case LVAL_BIG: args[i].kind = VM_REF; args[i].ref = c; break;
+      default: args[i].kind = VM_NUM; args[i].num = c->num; break;
+    }
+  }
+  vmval r = vm_reduce(v->cell[0]->op, args, n);
+  free(args);
+
+  if (r.kind != VM_NUM && r.kind != VM_INT && r.kind != VM_TEMP)
+  {
+    return v;
+  }
+
+  *eliminated += v->count;
+  lval_del(v);
+  switch (r.kind)
+  {
+    case VM_INT: return lval_int(r.inum);
+    case VM_TEMP: return r.ref;
+  }
+  return lval_num(r.num);
+}
+
+/* Folds v bottom up. The S-expressions whose children are still being
+ * folded wait on the walk stack, and each folded child is put back into
+ * the slot of its parent it came from.
+ */
+
+lval* lval_fold(lval* v, long* eliminated)
+{
+  if (v->type != LVAL_SEXPR)
+  {
+    return v;
+  }
+
+  int base = walk.depth;
+  walk_push(lval_unshare(v), NULL);
+  while (1)
+  {
+    walk_frame* f = &walk.frames[walk.depth - 1];
+    if (f->i < f->v->count)
+    {
+      lval* c = f->v->cell[f->i++];
+      if (c->type == LVAL_SEXPR)
+      {
+        c = lval_unshare(c);
+        f->v->cell[f->i - 1] = c;
+        walk_push(c, NULL);
+      }
+      continue;
+    }
+
+    walk.depth--;
+    lval* x = lval_fold_node(f->v, eliminated);
+    if (walk.depth == base)
+    {
+      return x;
+    }
+    f = &walk.frames[walk.depth - 1];
+    f->v->cell[f->i - 1] = x;
+  }
+}
+
+/* This is the parallel evaluator, used with --parallel N.
+ * The children of an S-expression don't depend on each other, so big ones
+ * can be evaluated on other threads. Each thread has a deque of tasks, it
+ * pushes and pops its own at the tail and steals from the head of the
+ * others when it runs out. A subtree is only handed out when it has at
+ * least par_threshold nodes, everything smaller is evaluated inline with
+ * the ordinary lval_eval(). The sizes are worked out once, up front, in
+ * pre-order, so looking one up while evaluating is O(1). So is whether a
+ * subtree has anything to split at all, a node with two big children
+ * somewhere under it. When it hasn't, as in a long chain of nested calls,
+ * the whole subtree goes to lval_eval() and its explicit stack rather
+ * than being walked one recursive call per level here.
+ *
+ * Children are still evaluated completely and lval_sexpr_apply() then
+ * looks at them in order, so the result, including which error wins, is
+ * exactly what lval_eval() gives. Each thread allocates from its own pool
+ * and arena.
+ */
+
+#define PAR_MAX_WORKERS 64
+
+/* How deep lval_eval_par() recurses before leaving the rest to lval_eval() */
+#define PAR_MAX_DEPTH 256
+
+typedef struct par_sizes
+{
+  int* sizes;
+  // Whether the subtree has a node with two children worth a task.
+  char* splits;
+  int count;
+} par_sizes;
+
+typedef struct par_task
+{
+  lval** slot;
+  par_sizes* sizes;
+  int index;
+  int depth;
+  atomic_int done;
+} par_task;
+
+typedef struct par_deque
+{
+  pthread_mutex_t lock;
+  par_task** tasks;
+
+  // Thieves take from head, the owner pushes and pops at tail.
+  int head;
+  int tail;
+  int cap;
+} par_deque;
+
+static int par_workers = 1;
+static int par_threshold = 10000;
+static par_deque par_deques[PAR_MAX_WORKERS];
+static arena* par_arenas[PAR_MAX_WORKERS];
+static atomic_int par_registered;
+
+// Set once par_workers is final, workers wait for it before stealing.
+static atomic_int par_ready;
+static _Thread_local int par_self = 0;
+
+// Tasks sitting in deques, idle workers sleep while it is zero.
+static atomic_int par_pending;
+static pthread_mutex_t par_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t par_idle = PTHREAD_COND_INITIALIZER;
+
+void par_push(par_task* t)
+{
+  par_deque* d = &par_deques[par_self];
+  pthread_mutex_lock(&d->lock);
+  if (d->tail == d->cap)
+  {
+    d->cap = d->cap ? d->cap * 2 : 64;
+    d->tasks = realloc(d->tasks, sizeof(par_task*) * d->cap);
+  }
+  d->tasks[d->tail++] = t;
+  pthread_mutex_unlock(&d->lock);
+
+  atomic_fetch_add(&par_pending, 1);
+  pthread_mutex_lock(&par_idle_lock);
+  pthread_cond_signal(&par_idle);
+  pthread_mutex_unlock(&par_idle_lock);
+}
+
+/* Takes a task off d, from the tail if it is our own deque */
+par_task* par_take(par_deque* d, int own)
+{
+  par_task* t = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail)
+  {
+    t = own ? d->tasks[--d->tail] : d->tasks[d->head++];
+    if (d->head == d->tail)
+    {
+      d->head = d->tail = 0;
+    }
+  }
+  pthread_mutex_unlock(&d->lock);
+
+  if (t != NULL)
+  {
+    atomic_fetch_sub(&par_pending, 1);
+  }
+  return t;
+}
+
+/* Our own newest task, or failing that the oldest one of someone else */
+par_task* par_find(void)
+{
+  par_task* t = par_take(&par_deques[par_self], 1);
+  for (int k = 1; t == NULL && k < par_workers; k++)
+  {
+    t = par_take(&par_deques[(par_self + k) % par_workers], 0);
+  }
+  return t;
+}
+
+lval* lval_eval_par(lval* v, par_sizes* s, int index, int depth);
+
+void par_run(par_task* t)
+{
+  *t->slot = lval_eval_par(*t->slot, t->sizes, t->index, t->depth);
+  atomic_store_explicit(&t->done, 1, memory_order_release);
+}
+
+void* par_worker(void* arg)
+{
+  par_self = (int)(intptr_t)arg;
+  par_arenas[par_self] = &line_arena;
+  atomic_fetch_add(&par_registered, 1);
+  while (!atomic_load(&par_ready))
+  {
+    sched_yield();
+  }
+
+  while (1)
+  {
+    par_task* t = par_find();
+    if (t != NULL)
+    {
+      par_run(t);
+      continue;
+    }
+
+    pthread_mutex_lock(&par_idle_lock);
+    while (atomic_load(&par_pending) == 0)
+    {
+      pthread_cond_wait(&par_idle, &par_idle_lock);
+    }
+    pthread_mutex_unlock(&par_idle_lock);
+  }
+  return NULL;
+}
+
+/* Starts n - 1 worker threads, the calling thread is worker 0 */
+void par_init(int n)
+{
+  n = n < 1 ? 1 : (n > PAR_MAX_WORKERS ? PAR_MAX_WORKERS : n);
+  for (int i = 0; i < n; i++)
+  {
+    pthread_mutex_init(&par_deques[i].lock, NULL);
+  }
+  par_arenas[0] = &line_arena;
+  atomic_store(&par_registered, 1);
+
+  /* Carry on with however many threads could be started, with none
+   * lval_eval_parallel() is just lval_eval()
+   */
+  int started = 1;
+  while (started < n)
+  {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, par_worker,
+      (void*)(intptr_t)started) != 0)
+    {
+      fprintf(stderr, "lispy: could only start %d of %d --parallel workers\n",
+        started, n);
+      break;
+    }
+    pthread_detach(thread);
+    started++;
+  }
+
+  /* Wait until every worker has registered its arena */
+  while (atomic_load(&par_registered) < started)
+  {
+    sched_yield();
+  }
+  par_workers = started;
+  atomic_store(&par_ready, 1);
+}
+
+/* Bytes used by the arenas of all threads */
+size_t arena_bytes_all(void)
+{
+  size_t bytes = line_arena.bytes;
+  for (int i = 1; i < par_workers; i++)
+  {
+    bytes += par_arenas[i]->bytes;
+  }
+  return bytes;
+}
+
+/* Resets the arenas of all threads, only safe while the workers are idle,
+ * which they are between lines.
+ */
+
+void arena_reset_all(void)
+{
+  if (stats_enabled)
+  {
+    stats_arena_reset();
+  }
+  arena_reset(&line_arena);
+  for (int i = 1; i < par_workers; i++)
+  {
+    arena_reset(par_arenas[i]);
+  }
+}
+
+/* Stores the number of nodes lval_eval() would visit under v, at v's
+ * pre-order index, along with whether the subtree can be split. Q-expressions
+ * aren't evaluated so they count as one. The nodes are listed in pre-order
+ * on the walk stack first, then filled in from the last one back, which
+ * sees every child before its parent.
+ */
+
+void par_measure(lval* v, par_sizes* s)
+{
+  int cap = 1024;
+  int count = 0;
+  lval** nodes = malloc(sizeof(lval*) * cap);
+  nodes[count++] = v;
+
+  int base = walk.depth;
+  walk_push(v, NULL);
+  while (walk.depth > base)
+  {
+    walk_frame* f = &walk.frames[walk.depth - 1];
+    if (f->v->type != LVAL_SEXPR || f->i == f->v->count)
+    {
+      walk.depth--;
+      continue;
+    }
+
+    lval* c = f->v->cell[f->i++];
+    if (count == cap)
+    {
+      cap *= 2;
+      nodes = realloc(nodes, sizeof(lval*) * cap);
+    }
+    nodes[count++] = c;
+    if (c->type == LVAL_SEXPR)
+    {
+      walk_push(c, NULL);
+    }
+  }
+
+  s->sizes = malloc(sizeof(int) * count);
+  s->splits = malloc(count);
+  s->count = count;
+  for (int index = count - 1; index >= 0; index--)
+  {
+    lval* x = nodes[index];
+    int n = 1;
+    int big = 0;
+    char split = 0;
+    if (x->type == LVAL_SEXPR)
+    {
+      int child = index + 1;
+      for (int i = 0; i < x->count; i++)
+      {
+        n += s->sizes[child];
+        big += s->sizes[child] >= par_threshold;
+        split |= s->splits[child];
+        child += s->sizes[child];
+      }
+    }
+    s->sizes[index] = n;
+    s->splits[index] = split || big >= 2;
+  }
+  free(nodes);
+}
+
+/* Evaluates v, whose pre-order index into s is index */
+lval* lval_eval_par(lval* v, par_sizes* s, int index, int depth)
+{
+  int* sizes = s->sizes;
+  if (v->type != LVAL_SEXPR || sizes[index] < par_threshold ||
+      !s->splits[index] || depth >= PAR_MAX_DEPTH)
+  {
+    return lval_eval(v);
+  }
+  v = lval_unshare(v);
+
+  /* Hand every big child but the last one to the pool */
+  par_task* tasks = NULL;
+  int ntasks = 0;
+  int pending = -1;
+  int pending_index = 0;
+  int child = index + 1;
+  for (int i = 0; i < v->count; i++)
+  {
+    if (sizes[child] < par_threshold)
+    {
+      v->cell[i] = lval_eval(v->cell[i]);
+    }
+    else
+    {
+      if (pending >= 0)
+      {
+        if (tasks == NULL)
+        {
+          tasks = malloc(sizeof(par_task) * v->count);
+        }
+        par_task* t = &tasks[ntasks++];
+        t->slot = &v->cell[pending];
+        t->sizes = s;
+        t->index = pending_index;
+        t->depth = depth + 1;
+        atomic_init(&t->done, 0);
+        par_push(t);
+      }
+      pending = i;
+      pending_index = child;
+    }
+    child += sizes[child];
+  }
+  if (pending >= 0)
+  {
+    v->cell[pending] =
+      lval_eval_par(v->cell[pending], s, pending_index, depth + 1);
+  }
+
+  /* Wait for the rest, helping out with whatever work there is */
+  for (int k = ntasks - 1; k >= 0; k--)
+  {
+    while (!atomic_load_explicit(&tasks[k].done, memory_order_acquire))
+    {
+      par_task* t = par_find();
+      if (t != NULL)
+      {
+        par_run(t);
+      }
+      else
+      {
+        sched_yield();
+      }
+    }
+  }
+  free(tasks);
+
+  return lval_sexpr_apply(v);
+}
+
+/* Entry point of the parallel evaluator, falls back to lval_eval() when
+ * there is only one worker.
+ */
+
+lval* lval_eval_parallel(lval* v)
+{
+  if (par_workers < 2)
+  {
+    return lval_eval(v);
+  }
+  par_sizes s = { 0 };
+  par_measure(v, &s);
+  lval* x = lval_eval_par(v, &s, 0, 0);
+  free(s.sizes);
+  free(s.splits);
+  return x;
+}
+
+/* Benchmarks, run with --bench.
+ * The trees are built straight from the constructors so the numbers
+ * only measure the interpreter and not the parser.
+ */
+
+double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* With bench_ints set the workloads are built from Integers instead */
+static int bench_ints = 0;
+
+lval* bench_leaf(void)
+{
+  return bench_ints ? lval_int(1) : lval_num(1.0);
+}
+
+/* (op 1.0 1.0 ... 1.0) with n operands */
+lval* bench_flat(char* op, int n)
+{
+  lval* x = lval_sexpr();
+  lval_reserve(x, n + 1);
+  x = lval_add(x, lval_sym(op));
+  for (int i = 0; i < n; i++)
+  {
+    x = lval_add(x, bench_leaf());
+  }
+  return x;
+}
+
+/* Balanced binary tree of (+ a b) nodes with 2^depth leaves */
+lval* bench_tree(int depth)
+{
+  if (depth == 0)
+  {
+    return bench_leaf();
+  }
+  lval* x = lval_sexpr();
+  x = lval_add(x, lval_sym("+"));
+  x = lval_add(x, bench_tree(depth-1));
+  x = lval_add(x, bench_tree(depth-1));
+  return x;
+}
+
+/* Right leaning chain (+ 1.0 (+ 1.0 ... 1.0)) nested depth levels deep,
+ * built bottom up so making it doesn't recurse either.
+ */
+
+lval* bench_chain(int depth)
+{
+  lval* x = lval_num(1.0);
+  for (int i = 0; i < depth; i++)
+  {
+    lval* y = lval_sexpr();
+    y = lval_add(y, lval_sym("+"));
+    y = lval_add(y, lval_num(1.0));
+    y = lval_add(y, x);
+    x = y;
+  }
+  return x;
+}
+
+/* Evaluates fresh copies of a workload reps times and reports the
+ * number of nodes evaluated per second.
+ */
+
+double bench_eval_rate(lval* (*make)(int), int arg, long nodes, int reps)
+{
+  double total = 0;
+  for (int r = 0; r < reps; r++)
+  {
+    lval* x = make(arg);
+    double start = bench_now();
+    x = lval_eval(x);
+    total += bench_now() - start;
+    lval_del(x);
+  }
+  return nodes * reps / total;
+}
+
+void bench_eval(char* name, lval* (*make)(int), int arg, long nodes, int reps)
+{
+  printf("%-12s %10ld nodes  %12.0f nodes/s\n",
+    name, nodes, bench_eval_rate(make, arg, nodes, reps));
+}
+
+/* The lval layout and evaluator from before the layout was packed into
+ * a tagged union, kept so --bench can time the same tree before and
+ * after. It is the old code as it was, malloc() per node, strings copied,
+ * recursion and strcmp() on the operator, only renamed.
+ */
+
+typedef struct legacy_lval
+{
+  int type;
+  double num;
+  char* err;
+  char* sym;
+  int count;
+  struct legacy_lval** cell;
+} legacy_lval;
+
+legacy_lval* legacy_num(double x)
+{
+  legacy_lval* v = malloc(sizeof(legacy_lval));
+  v->type = LVAL_NUM;
+  v->num = x;
+  return v;
+}
+
+legacy_lval* legacy_err(char* m)
+{
+  legacy_lval* v = malloc(sizeof(legacy_lval));
+  v->type = LVAL_ERR;
+  v->err = malloc(strlen(m) + 1);
+  strcpy(v->err, m);
+  return v;
+}
+
+legacy_lval* legacy_sym(char* s)
+{
+  legacy_lval* v = malloc(sizeof(legacy_lval));
+  v->type = LVAL_SYM;
+  v->sym = malloc(strlen(s) + 1);
+  strcpy(v->sym, s);
+  return v;
+}
+
+legacy_lval* legacy_sexpr(void)
+{
+  legacy_lval* v = malloc(sizeof(legacy_lval));
+  v->type = LVAL_SEXPR;
+  v->count = 0;
+  v->cell = NULL;
+  return v;
+}
+
+legacy_lval* legacy_add(legacy_lval* v, legacy_lval* x)
+{
+  v->count++;
+  v->cell = realloc(v->cell, sizeof(legacy_lval*) * v->count);
+  v->cell[v->count-1] = x;
+  return v;
+}
+
+void legacy_del(legacy_lval* v)
+{
+  switch (v->type)
+  {
+    case LVAL_NUM: break;
+    case LVAL_ERR: free(v->err); break;
+    case LVAL_SYM: free(v->sym); break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < v->count; i++)
+      {
+        legacy_del(v->cell[i]);
+      }
+      free(v->cell);
+    break;
+  }
+  free(v);
+}
+
+legacy_lval* legacy_pop(legacy_lval* v, int i)
+{
+  legacy_lval* x = v->cell[i];
+  memmove(&v->cell[i], &v->cell[i+1],
+    sizeof(legacy_lval*) * (v->count-i-1));
+  v->count--;
+  v->cell = realloc(v->cell, sizeof(legacy_lval*) * v->count);
+  return x;
+}
+
+legacy_lval* legacy_take(legacy_lval* v, int i)
+{
+  legacy_lval* x = legacy_pop(v, i);
+  legacy_del(v);
+  return x;
+}
+
+legacy_lval* legacy_builtin_op(legacy_lval* a, char* op)
+{
+  for (int i = 0; i < a->count; i++)
+  {
+    if (a->cell[i]->type != LVAL_NUM)
+    {
+      legacy_del(a);
+      return legacy_err("Cannot operator on non number!");
+    }
+  }
+
+  legacy_lval* x = legacy_pop(a, 0);
+  if ((strcmp(op, "-") == 0) && a->count == 0)
+  {
+    x->num = -x->num;
+  }
+
+  while (a->count > 0)
+  {
+    legacy_lval* y = legacy_pop(a, 0);
+    if (strcmp(op, "+") == 0) { x->num += y->num; }
+    if (strcmp(op, "-") == 0) { x->num -= y->num; }
+    if (strcmp(op, "*") == 0) { x->num *= y->num; }
+    if (strcmp(op, "/") == 0)
+    {
+      if (y->num == 0)
+      {
+        legacy_del(x); legacy_del(y);
+        x = legacy_err("Division By Zero.");
+        break;
+      }
+      x->num /= y->num;
+    }
+    if (strcmp(op, "%") == 0) { x->num = fmod(x->num, y->num); }
+    if (strcmp(op, "^") == 0) { x->num = pow(x->num, y->num); }
+    legacy_del(y);
+  }
+  legacy_del(a);
+  return x;
+}
+
+legacy_lval* legacy_eval(legacy_lval* v);
+
+legacy_lval* legacy_eval_sexpr(legacy_lval* v)
+{
+  for (int i = 0; i < v->count; i++)
+  {
+    v->cell[i] = legacy_eval(v->cell[i]);
+  }
+  for (int i = 0; i < v->count; i++)
+  {
+    if (v->cell[i]->type == LVAL_ERR)
+    {
+      return legacy_take(v, i);
+    }
+  }
+  if (v->count == 0)
+  {
+    return v;
+  }
+  if (v->count == 1)
+  {
+    return legacy_take(v, 0);
+  }
+
+  legacy_lval* f = legacy_pop(v, 0);
+  if (f->type != LVAL_SYM)
+  {
+    legacy_del(f);
+    legacy_del(v);
+    return legacy_err("S-expression Does not start with symbol.");
+  }
+  legacy_lval* result = legacy_builtin_op(v, f->sym);
+  legacy_del(f);
+  return result;
+}
+
+legacy_lval* legacy_eval(legacy_lval* v)
+{
+  if (v->type == LVAL_SEXPR)
+  {
+    return legacy_eval_sexpr(v);
+  }
+  return v;
+}
+
+/* bench_tree() in the old layout */
+legacy_lval* legacy_tree(int depth)
+{
+  if (depth == 0)
+  {
+    return legacy_num(1.0);
+  }
+  legacy_lval* x = legacy_sexpr();
+  legacy_add(x, legacy_sym("+"));
+  legacy_add(x, legacy_tree(depth-1));
+  legacy_add(x, legacy_tree(depth-1));
+  return x;
+}
+
+/* Prints the node size of both layouts, and evaluates the same tree with
+ * each, lval_eval() on the current one and legacy_eval() on the old one.
+ */
+
+void bench_layout(int depth, int reps)
+{
+  long nodes = (2L << depth) - 1;
+  double now = bench_eval_rate(bench_tree, depth, nodes, reps);
+
+  double total = 0;
+  for (int r = 0; r < reps; r++)
+  {
+    legacy_lval* x = legacy_tree(depth);
+    double start = bench_now();
+    x = legacy_eval(x);
+    total += bench_now() - start;
+    legacy_del(x);
+  }
+
+  printf("lval layout: %zu bytes per node, %zu before packing\n",
+    sizeof(lval), sizeof(legacy_lval));
+  printf("layout eval  %10ld nodes  %12.0f nodes/s  before %12.0f nodes/s\n",
+    nodes, now, nodes * reps / total);
+}
+
+lval* bench_make_sum(int n) { return bench_flat("+", n); }
+lval* bench_make_mul(int n) { return bench_flat("*", n); }
+lval* bench_make_mod(int n) { return bench_flat("%", n); }
+lval* bench_make_pow(int n) { return bench_flat("^", n); }
+
+/* The same workloads built from Integers and from doubles. The Integer
+ * paths check every step for overflow, so this shows what that costs
+ * against the all-double loops, most of which can use SIMD.
+ */
+
+void bench_int(void)
+{
+  char* names[] = { "tree", "sum", "mul", "mod", "pow" };
+  lval* (*makes[])(int) =
+    { bench_tree, bench_make_sum, bench_make_mul, bench_make_mod,
+      bench_make_pow };
+  for (int k = 0; k < (int)(sizeof(names) / sizeof(names[0])); k++)
+  {
+    int arg = k == 0 ? 16 : 1000;
+    long nodes = k == 0 ? (2L << 16) - 1 : 1001;
+    int reps = k == 0 ? 20 : 2000;
+    bench_ints = 1;
+    double ints = bench_eval_rate(makes[k], arg, nodes, reps);
+    bench_ints = 0;
+    double nums = bench_eval_rate(makes[k], arg, nodes, reps);
+    printf("int %-8s %10ld nodes  int %12.0f  double %12.0f nodes/s  %5.2fx\n",
+      names[k], nodes, ints, nums, ints / nums);
+  }
+}
+
+/* Same as bench_eval() but compiles the workload once and then runs the
+ * bytecode reps times.
+ */
+
+void bench_vm(char* name, lval* (*make)(int), int arg, long nodes, int reps)
+{
+  lval* x = make(arg);
+  lprog* p = lval_compile(x);
+  lval_del(x);
+
+  double start = bench_now();
+  for (int r = 0; r < reps; r++)
+  {
+    lval_del(lprog_run(p));
+  }
+  double total = bench_now() - start;
+  lprog_del(p);
+
+  printf("%-12s %10ld nodes  %12.0f nodes/s\n",
+    name, nodes, nodes * reps / total);
+}
+
+/* Evaluates (+ 1.0 ... 1.0) for growing n and reports the time per
+ * operand, which stays flat when builtin_op is linear in its arguments.
+ */
+
+void bench_scaling(void)
+{
+  for (int n = 1000; n <= 1000000; n *= 10)
+  {
+    int reps = 10000000 / n;
+    double total = 0;
+    for (int r = 0; r < reps; r++)
+    {
+      lval* x = bench_flat("+", n);
+      double start = bench_now();
+      x = lval_eval(x);
+      total += bench_now() - start;
+      lval_del(x);
+    }
+    printf("scaling %8d operands  %8.2f ns/operand\n",
+      n, total * 1e9 / ((double)n * reps));
+  }
+}
+
+/* Times lreduce() over n ones for every implementation the CPU has */
+void bench_simd(void)
+{
+  char* names[] = { "scalar", "sse2", "avx2" };
+  double (*impls[])(double*, int, int) =
+  {
+    lreduce_scalar,
+#ifdef LISPY_X86
+    __builtin_cpu_supports("sse2") ? lreduce_sse2 : NULL,
+    __builtin_cpu_supports("avx2") ? lreduce_avx2 : NULL,
+#endif
+  };
+
+  for (int n = 10; n <= 1000000; n *= 10)
+  {
+    double* xs = malloc(sizeof(double) * n);
+    for (int i = 0; i < n; i++)
+    {
+      xs[i] = 1.0 + i * 1e-9;
+    }
+
+    int reps = 100000000 / n;
+    printf("simd %8d operands ", n);
+    for (int k = 0; k < (int)(sizeof(impls) / sizeof(impls[0])); k++)
+    {
+      if (impls[k] == NULL)
+      {
+        continue;
+      }
+      volatile double sink = 0;
+      double start = bench_now();
+      for (int r = 0; r < reps; r++)
+      {
+        sink += impls[k](xs, n, LOP_ADD);
+      }
+      double total = bench_now() - start;
+      printf(" %s %6.3f ns/op", names[k], total * 1e9 / ((double)n * reps));
+    }
+    printf("\n");
+    free(xs);
+  }
+}
+
+/* Random magnitude of n limbs with a nonzero top limb */
+uint32_t* bench_limbs(int n, uint64_t* seed)
+{
+  uint32_t* d = big_new(n);
+  for (int i = 0; i < n; i++)
+  {
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    d[i] = (*seed >> 33) % BIG_BASE;
+  }
+  d[n-1] |= 1;
+  return d;
+}
+
+/* Milliseconds per call of big_mul_mag() on two n limb operands */
+double bench_big_mul(uint32_t* r, uint32_t* a, uint32_t* b, int n)
+{
+  int reps = 0;
+  double start = bench_now(), total;
+  do
+  {
+    big_mul_mag(r, a, n, b, n);
+    reps++;
+    total = bench_now() - start;
+  } while (total < 0.2);
+  return total * 1e3 / reps;
+}
+
+/* Bignum multiplication, schoolbook against Karatsuba, and printing
+ * and reading for operands of 1k to 1M digits. Schoolbook stops at 100k
+ * digits, past that a single product takes many seconds. The last line
+ * sweeps the Karatsuba threshold, which is how big_karatsuba_min was
+ * picked.
+ */
+
+void bench_big(void)
+{
+  uint64_t seed = 42;
+  int saved = big_karatsuba_min;
+  for (int digits = 1000; digits <= 1000000; digits *= 10)
+  {
+    int n = digits / BIG_DIGITS;
+    uint32_t* a = bench_limbs(n, &seed);
+    uint32_t* b = bench_limbs(n, &seed);
+    uint32_t* r = big_new(2 * n);
+
+    double kara = bench_big_mul(r, a, b, n);
+    double school = 0;
+    if (digits <= 100000)
+    {
+      big_karatsuba_min = n + 1;
+      school = bench_big_mul(r, a, b, n);
+      big_karatsuba_min = saved;
+    }
+
+    /* Print the product and read it back */
+    bigint p = { .d = r, .n = big_trim(r, 2 * n) };
+    lval* x = lval_big(&p);
+    writer w = { 0 };
+    double start = bench_now();
+    writer_big(&w, x);
+    double print = bench_now() - start;
+    start = bench_now();
+    lval* y = lval_int_parse(w.data, w.data + w.len);
+    double read = bench_now() - start;
+    if (!lval_equal(x, y))
+    {
+      printf("big: %d digits did not read back\n", digits);
+    }
+
+    printf("big %8d digits  karatsuba %10.3f ms", digits, kara);
+    if (school > 0)
+    {
+      printf("  schoolbook %10.3f ms", school);
+    }
+    printf("  print %8.3f ms  read %8.3f ms\n", print * 1e3, read * 1e3);
+
+    lval_del(x);
+    lval_del(y);
+    free(w.data);
+    free(a);
+    free(b);
+  }
+
+  int n = 10000 / BIG_DIGITS;
+  uint32_t* a = bench_limbs(n, &seed);
+  uint32_t* b = bench_limbs(n, &seed);
+  uint32_t* r = big_new(2 * n);
+  int thresholds[] = { 8, 12, 16, 20, 24, 32, 48, 64, 128 };
+  printf("karatsuba threshold, 10k digits:");
+  for (int k = 0; k < (int)(sizeof(thresholds) / sizeof(int)); k++)
+  {
+    big_karatsuba_min = thresholds[k];
+    printf(" %d %.3f ms", thresholds[k], bench_big_mul(r, a, b, n));
+  }
+  printf("\n");
+  big_karatsuba_min = saved;
+  free(a);
+  free(b);
+  free(r);
+}
+
+/* Microseconds per call of one of the bench_share() operations */
+double bench_share_op(lval* q, lval* (*copy)(lval*), int op)
+{
+  int reps = 0;
+  double start = bench_now(), total;
+  do
+  {
+    lval* c = copy(q);
+    if (op == 1)
+    {
+      c = lval_take(c, 0);
+    }
+    if (op == 2)
+    {
+      c = lval_add(c, lval_int(reps));
+    }
+    lval_del(c);
+    reps++;
+    total = bench_now() - start;
+  } while (total < 0.2);
+  return total * 1e6 / reps;
+}
+
+/* Passing a big Q-expression around, taking its first element and
+ * adding one to it, with copies that share (lval_copy) against the deep
+ * copies everything used to make (lval_deep_copy). Adding copies the top
+ * list, since the original is still around.
+ */
+
+void bench_share(void)
+{
+  char* names[] = { "pass", "head", "add" };
+  for (int size = 10; size <= 10000; size *= 10)
+  {
+    lval* q = lval_qexpr();
+    for (int i = 0; i < size; i++)
+    {
+      q = lval_add(q, bench_tree(5));
+    }
+    long nodes = (long)size * ((2L << 5) - 1) + 1;
+    for (int op = 0; op < 3; op++)
+    {
+      double shared = bench_share_op(q, lval_copy, op);
+      double deep = bench_share_op(q, lval_deep_copy, op);
+      printf("share %-4s %8ld nodes  shared %10.3f us  deep %10.3f us  %8.1fx\n",
+        names[op], nodes, shared, deep, deep / shared);
+    }
+    lval_del(q);
+  }
+}
+
+/* Throughput of the --jobs batch mode for growing worker counts, on a
+ * script of independent forms that is read from memory.
+ */
+
+long jobs_run(reader* r, int n, int print);
+
+void bench_jobs(void)
+{
+  int forms = 20000;
+  size_t cap = (size_t)forms * 64 * 12;
+  char* src = malloc(cap);
+  size_t len = 0;
+  for (int i = 0; i < forms; i++)
+  {
+    len += sprintf(src + len, "(+");
+    for (int k = 0; k < 4; k++)
+    {
+      len += sprintf(src + len, " (*");
+      for (int m = 0; m < 12; m++)
+      {
+        len += sprintf(src + len, " %d.5", (i + k + m) % 7);
+      }
+      len += sprintf(src + len, ")");
+    }
+    len += sprintf(src + len, ")\n");
+  }
+
+  double base = 0;
+  for (int n = 1; n <= 8; n *= 2)
+  {
+    reader r = { .name = "<bench>", .start = src, .end = src + len, .pos = src };
+    double start = bench_now();
+    long count = jobs_run(&r, n, 0);
+    double total = bench_now() - start;
+    free(r.stack);
+    if (count < 0)
+    {
+      break;
+    }
+    if (n == 1)
+    {
+      base = total;
+    }
+    printf("jobs %2d workers  %10.0f forms/s  %5.2fx\n",
+      n, count / total, base / total);
+  }
+  free(src);
+}
+
+/* lval_eval() on the whole tree from the explicit stack, as it runs
+ * below EVAL_RECURSE_DEPTH.
+ */
+lval* bench_eval_stack(lval* v)
+{
+  return lval_eval_stack(v, 0);
+}
+
+/* The recursive evaluator against lval_eval(), which recurses near the
+ * root too, and against the explicit stack alone. The deep chain would
+ * overflow the C stack with the recursive one, so it only runs on
+ * lval_eval().
+ */
+
+void bench_stack(void)
+{
+  lval* (*evals[])(lval*) =
+    { lval_eval_recursive, lval_eval, bench_eval_stack };
+  char* names[] = { "tree (recursive)", "tree (lval_eval)", "tree (stack)" };
+  for (int k = 0; k < 3; k++)
+  {
+    double total = 0;
+    int reps = 20;
+    for (int r = 0; r < reps; r++)
+    {
+      lval* x = bench_tree(16);
+      double start = bench_now();
+      x = evals[k](x);
+      total += bench_now() - start;
+      lval_del(x);
+    }
+    printf("%-16s %10ld nodes  %12.0f nodes/s\n",
+      names[k], (2L << 16) - 1, ((2L << 16) - 1) * reps / total);
+  }
+
+  int depth = 1000000;
+  lval* x = bench_chain(depth);
+  double start = bench_now();
+  x = lval_eval(x);
+  double total = bench_now() - start;
+  lval_del(x);
+  printf("chain (stack) %10d deep   %12.0f nodes/s\n",
+    depth, 3.0 * depth / total);
+}
+
+/* mpc AST of (+ 1.0 (+ 1.0 ... 1.0)) nested depth levels deep, the way
+ * the grammar in main() tags it.
+ */
+
+mpc_ast_t* bench_ast_chain(int depth)
+{
+  mpc_ast_t* x = mpc_ast_new("expr|number|regex", "1.0");
+  for (int i = 0; i < depth; i++)
+  {
+    mpc_ast_t* y = mpc_ast_new("expr|sexpr|>", "");
+    mpc_ast_add_child(y, mpc_ast_new("char", "("));
+    mpc_ast_add_child(y, mpc_ast_new("expr|symbol|char", "+"));
+    mpc_ast_add_child(y, mpc_ast_new("expr|number|regex", "1.0"));
+    mpc_ast_add_child(y, x);
+    mpc_ast_add_child(y, mpc_ast_new("char", ")"));
+    x = y;
+  }
+  mpc_ast_t* root = mpc_ast_new(">", "");
+  mpc_ast_add_child(root, mpc_ast_new("regex", ""));
+  mpc_ast_add_child(root, x);
+  mpc_ast_add_child(root, mpc_ast_new("regex", ""));
+  return root;
+}
+
+/* mpc AST of (+ 1.0 1.0 ...) with n operands */
+mpc_ast_t* bench_ast_fan(int n)
+{
+  mpc_ast_t* x = mpc_ast_new("expr|sexpr|>", "");
+  mpc_ast_add_child(x, mpc_ast_new("char", "("));
+  mpc_ast_add_child(x, mpc_ast_new("expr|symbol|char", "+"));
+  for (int i = 0; i < n; i++)
+  {
+    mpc_ast_add_child(x, mpc_ast_new("expr|number|regex", "1.0"));
+  }
+  mpc_ast_add_child(x, mpc_ast_new("char", ")"));
+  mpc_ast_t* root = mpc_ast_new(">", "");
+  mpc_ast_add_child(root, mpc_ast_new("regex", ""));
+  mpc_ast_add_child(root, x);
+  mpc_ast_add_child(root, mpc_ast_new("regex", ""));
+  return root;
+}
+
+/* Points stdout at /dev/null for the printing benchmarks, returns the
+ * descriptor to put back with bench_unmute().
+ */
+
+int bench_mute(void)
+{
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+  return saved;
+}
+
+void bench_unmute(int saved)
+{
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+}
+
+/* Reading, printing and deleting a deep chain and a wide fan, in ns per
+ * node. Printing goes to /dev/null. The ASTs are smaller since mpc's own
+ * parser and mpc_ast_delete() still recurse.
+ */
+
+void bench_walk(void)
+{
+  char* shapes[] = { "chain", "fan" };
+  for (int k = 0; k < 2; k++)
+  {
+    int n = k == 0 ? 10000 : 100000;
+    mpc_ast_t* t = k == 0 ? bench_ast_chain(n) : bench_ast_fan(n);
+
+    /* The first round is a warmup and isn't counted */
+    double total = 0;
+    for (int r = 0; r <= 10; r++)
+    {
+      double start = bench_now();
+      lval* x = lval_read(t);
+      total += r > 0 ? bench_now() - start : 0;
+      lval_del(x);
+    }
+    printf("read   %-5s %8d nodes  %8.2f ns/node\n",
+      shapes[k], n, total * 1e9 / (10.0 * n));
+    mpc_ast_delete(t);
+  }
+
+  for (int k = 0; k < 2; k++)
+  {
+    int n = 1000000;
+    lval* x = k == 0 ? bench_chain(n) : bench_flat("+", n);
+
+    int saved = bench_mute();
+    double start = bench_now();
+    lval_println(x);
+    fflush(stdout);
+    double printed = bench_now() - start;
+    bench_unmute(saved);
+
+    start = bench_now();
+    lval_del(x);
+    double deleted = bench_now() - start;
+    printf("print  %-5s %8d nodes  %8.2f ns/node\n",
+      shapes[k], n, printed * 1e9 / n);
+    printf("delete %-5s %8d nodes  %8.2f ns/node\n",
+      shapes[k], n, deleted * 1e9 / n);
+  }
+}
+
+/* Printing throughput in MB/s, for a packed list of a million numbers
+ * and a boxed tree, with the shortest and the legacy number format.
+ */
+
+void bench_output(void)
+{
+  lval* packed = lval_qexpr();
+  for (int i = 0; i < 1000000; i++)
+  {
+    packed = lval_add(packed, lval_num(i / 7.0));
+  }
+  lval* tree = bench_tree(18);
+  lval* values[] = { packed, tree };
+  char* names[] = { "packed", "tree" };
+  int keep = legacy_float;
+
+  for (int k = 0; k < 2; k++)
+  {
+    for (int legacy = 0; legacy < 2; legacy++)
+    {
+      legacy_float = legacy;
+      int saved = bench_mute();
+      double start = bench_now();
+      size_t bytes = 0;
+      for (int r = 0; r < 5; r++)
+      {
+        lval_write(&out, values[k]);
+        bytes += out.len;
+        writer_flush(&out, stdout);
+      }
+      fflush(stdout);
+      double total = bench_now() - start;
+      bench_unmute(saved);
+      printf("output %-6s %-8s %8.1f MB/s\n", names[k],
+        legacy ? "%f" : "shortest", bytes / total / 1e6);
+    }
+  }
+  legacy_float = keep;
+  lval_del(packed);
+  lval_del(tree);
+}
+
+/* The benchmark suite, run with --bench-suite. Every workload is built at
+ * --bench-size nodes, printed to text once, and then each repetition
+ * times the four phases separately: reading the text back, printing it,
+ * evaluating it and deleting a second copy. The first --bench-warmup
+ * repetitions aren't counted, the next --bench-reps are. Results go to
+ * stdout as CSV, or JSON with --bench-format json, one record per
+ * workload and phase with percentiles in nanoseconds, so two runs can be
+ * diffed to spot regressions.
+ */
+
+static int bench_suite_enabled = 0;
+static int suite_reps = 20;
+static int suite_warmup = 3;
+static int suite_size = 100000;
+static int suite_json = 0;
+
+/* Balanced tree with about n nodes */
+lval* suite_tree(int n)
+{
+  int depth = 0;
+  while ((4 << depth) <= n)
+  {
+    depth++;
+  }
+  return bench_tree(depth);
+}
+
+lval* suite_flat(int n) { return bench_flat("+", n); }
+
+/* Q-expression of n numbers, so a packed one */
+lval* suite_qexpr(int n)
+{
+  lval* x = lval_qexpr();
+  lval_reserve(x, n);
+  for (int i = 0; i < n; i++)
+  {
+    x = lval_add(x, lval_num(i * 0.25));
+  }
+  return x;
+}
+
+int suite_cmp(const void* a, const void* b)
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of n sorted times */
+double suite_percentile(double* t, int n, double q)
+{
+  int rank = (int)ceil(q * n);
+  return t[rank < 1 ? 0 : rank - 1];
+}
+
+void suite_report(char* workload, char* phase, double* t, int n, int first)
+{
+  qsort(t, n, sizeof(double), suite_cmp);
+  double sum = 0;
+  for (int i = 0; i < n; i++)
+  {
+    sum += t[i];
+  }
+  double ns[] =
+  {
+    t[0] * 1e9, sum / n * 1e9, suite_percentile(t, n, 0.5) * 1e9,
+    suite_percentile(t, n, 0.9) * 1e9, suite_percentile(t, n, 0.99) * 1e9,
+    t[n - 1] * 1e9
+  };
+
+  if (suite_json)
+  {
+    printf("%s  {\"workload\": \"%s\", \"size\": %d, \"phase\": \"%s\", "
+      "\"reps\": %d, \"min_ns\": %.0f, \"mean_ns\": %.0f, \"p50_ns\": %.0f, "
+      "\"p90_ns\": %.0f, \"p99_ns\": %.0f, \"max_ns\": %.0f}",
+      first ? "" : ",\n", workload, suite_size, phase, n,
+      ns[0], ns[1], ns[2], ns[3], ns[4], ns[5]);
+  }
+  else
+  {
+    printf("%s,%d,%s,%d,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f\n",
+      workload, suite_size, phase, n,
+      ns[0], ns[1], ns[2], ns[3], ns[4], ns[5]);
+  }
+}
+
+void bench_suite(void)
+{
+  char* names[] = { "flat", "chain", "tree", "qexpr" };
+  lval* (*makes[])(int) = { suite_flat, bench_chain, suite_tree, suite_qexpr };
+  char* phases[] = { "read", "print", "eval", "delete" };
+  int reps = suite_reps < 1 ? 1 : suite_reps;
+  double* times[4];
+  for (int p = 0; p < 4; p++)
+  {
+    times[p] = malloc(sizeof(double) * reps);
+  }
+
+  if (suite_json)
+  {
+    printf("[\n");
+  }
+  else
+  {
+    printf("workload,size,phase,reps,min_ns,mean_ns,p50_ns,p90_ns,p99_ns,max_ns\n");
+  }
+
+  for (int k = 0; k < 4; k++)
+  {
+    writer text = { 0 };
+    lval* x = makes[k](suite_size);
+    lval_write(&text, x);
+    lval_del(x);
+
+    char error[256];
+    int saved = bench_mute();
+    for (int r = -suite_warmup; r < reps; r++)
+    {
+      double t[4];
+      double start = bench_now();
+      x = lval_read_str("<bench>", text.data, text.len, error, sizeof(error));
+      t[0] = bench_now() - start;
+
+      start = bench_now();
+      lval_println(x);
+      fflush(stdout);
+      t[1] = bench_now() - start;
+
+      start = bench_now();
+      x = lval_eval(x);
+      t[2] = bench_now() - start;
+      lval_del(x);
+
+      lval* y = lval_read_str("<bench>", text.data, text.len, error, sizeof(error));
+      start = bench_now();
+      lval_del(y);
+      t[3] = bench_now() - start;
+
+      for (int p = 0; p < 4 && r >= 0; p++)
+      {
+        times[p][r] = t[p];
+      }
+    }
+    bench_unmute(saved);
+    free(text.data);
+
+    for (int p = 0; p < 4; p++)
+    {
+      suite_report(names[k], phases[p], times[p], reps, k == 0 && p == 0);
+    }
+  }
+
+  if (suite_json)
+  {
+    printf("\n]\n");
+  }
+  for (int p = 0; p < 4; p++)
+  {
+    free(times[p]);
+  }
+}
+
+void bench_run(void)
+{
+  bench_layout(16, 20);
+  bench_eval("tree", bench_tree, 16, (2L << 16) - 1, 20);
+  bench_eval("sum", bench_make_sum, 1000, 1001, 2000);
+  bench_stack();
+  bench_walk();
+  bench_output();
+  bench_vm("tree (vm)", bench_tree, 16, (2L << 16) - 1, 20);
+  bench_vm("sum (vm)", bench_make_sum, 1000, 1001, 2000);
+  bench_scaling();
+  bench_simd();
+  bench_int();
+  bench_big();
+  bench_share();
+  bench_jobs();
+}
+
+/* Options set from the command line */
+
+// Parse with the mpc grammar instead of the native reader.
+static int use_mpc = 0;
+
+// Evaluate with the bytecode VM, optionally checking it against lval_eval.
+static int use_vm = 0;
+static int vm_check = 0;
+
+// Fold constant subexpressions before evaluating, and how many nodes
+// that has removed so far, added to from every --jobs worker.
+static int use_fold = 0;
+static atomic_long fold_eliminated;
+
+// Worker threads for the batch mode, see jobs_run().
+static int jobs_workers = 1;
+
+/* Evaluates one read expression the way the options ask for. Both the
+ * REPL and the batch mode go through here.
+ */
+
+lval* lispy_eval(lval* x)
 {
-  // Increasing the count 
-  v->count++;
-  
-  // Reallocating memory with the new count size 
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  /* The folder and the VM don't use the eval stack, but they have to turn
+   * down the same inputs lval_eval() does.
+   */
+  if ((use_fold || use_vm) && !eval_fits(x))
+  {
+    lval_del(x);
+    return lval_err("Nesting exceeds the evaluation budget.");
+  }
 
-  // assigning the last cell to the new lval type.
-  v->cell[v->count-1] = x;
-  return v;
+  if (use_fold)
+  {
+    long eliminated = 0;
+    x = lval_fold(x, &eliminated);
+    atomic_fetch_add(&fold_eliminated, eliminated);
+  }
+
+  if (!use_vm)
+  {
+    return lval_eval_parallel(x);
+  }
+
+  lprog* p = lval_compile(x);
+  lval* y = lprog_run(p);
+
+  /* Differential check against the tree walker */
+  if (vm_check)
+  {
+    lval* ref = lval_eval(lval_copy(x));
+    if (!lval_equal(ref, y))
+    {
+      printf("vm mismatch, lval_eval gave: ");
+      lval_println(ref);
+    }
+    lval_del(ref);
+  }
+
+  lprog_del(p);
+  lval_del(x);
+  return y;
 }
 
-/* This function takes in an abstract syntax tree and converts it into s-expressions
- * by ckecking the tag of the branch. It then determines the type and constructs 
- * lvals related to those tags, if the tag contains ">" or "sexpr" then it creates 
- * an empty sexpr type lval. It then loops through all the children of the baranch
- * and adds them to the sexpr by using the lval_add() function. It returns an lval 
- * of the type x which effectively contains all the inpupt that the user typed.
+/* Reads all of a file, or stdin for "-", into a heap buffer */
+char* batch_slurp(char* path, size_t* size)
+{
+  FILE* f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+  if (f == NULL)
+  {
+    return NULL;
+  }
+
+  size_t cap = 1 << 16, n = 0, got;
+  char* buf = malloc(cap);
+  while ((got = fread(buf + n, 1, cap - n, f)) > 0)
+  {
+    n += got;
+    if (n == cap)
+    {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+  }
+
+  if (f != stdin)
+  {
+    fclose(f);
+  }
+  *size = n;
+  return buf;
+}
+
+/* Maps a regular file read only, so the reader can scan it in place
+ * without copying it into the heap first. The mapping outlives the file
+ * descriptor and lasts until batch_run() unmaps it, numbers are converted
+ * straight out of it and symbols are interned from it. Returns NULL for
+ * pipes, terminals, empty files or anything else that can't be mapped,
+ * the caller then falls back to batch_slurp().
  */
-lval* lval_read(mpc_ast_t* t) 
+
+char* batch_map(char* path, size_t* size)
 {
-  
-  /* If Symbol or Number return conversion to that type */
-  if (strstr(t->tag, "number"))
+#ifdef _WIN32
+  return NULL;
+#else
+  /* stdin redirected from a file can be mapped too */
+  int is_stdin = strcmp(path, "-") == 0;
+  int fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+  if (fd < 0)
   {
-    return lval_read_num(t); 
+    return NULL;
   }
-  if (strstr(t->tag, "symbol"))
+
+  struct stat st;
+  void* p = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
   {
-    return lval_sym(t->contents); 
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
   }
-  
-  /* If root (>) or sexpr then create empty list */
-  lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0)
+  if (!is_stdin)
   {
-    x = lval_sexpr(); 
-  } 
-  if (strstr(t->tag, "sexpr"))
+    close(fd);
+  }
+  if (p == MAP_FAILED)
   {
-    x = lval_sexpr(); 
+    return NULL;
   }
-  if (strstr(t->tag, "qexpr"))
+
+  /* The reader goes through it front to back exactly once */
+  madvise(p, st.st_size, MADV_SEQUENTIAL);
+  *size = st.st_size;
+  return p;
+#endif
+}
+
+/* This is the batch mode, lispy -f script.lspy or a script piped into
+ * stdin. There is no prompt, no editline and no history, every top level
+ * expression in the script is read and evaluated on its own, one after
+ * the other, and its result printed on a line. Output goes through a
+ * large stdio buffer instead of being flushed per line. At exit the
+ * number of expressions and the rate they ran at is reported on stderr.
+ * Script files are memory mapped where possible, see batch_map().
+ *
+ * With --mpc the whole script is parsed by the mpc grammar up front, and
+ * the top level expressions in its AST are then read and evaluated one
+ * at a time the same way. --jobs needs the native reader and is ignored.
+ */
+
+/* Multi-core batch mode, used with --jobs N.
+ * Top-level forms don't depend on each other, so the main thread reads
+ * them into a window of slots and N worker threads evaluate them, each
+ * one allocating from its own thread-local pool. The window doubles as a
+ * reorder buffer: the main thread prints the slot at the head as soon as
+ * it is done, so the output comes out in input order no matter which
+ * worker finished first, and a slot is only reused once it is printed.
+ *
+ * Workers also serialize and delete their results, the main thread only
+ * writes out the text. Reading stays on the main thread because the
+ * symbol table isn't thread-safe. There is no point between forms where
+ * every thread is idle, so --arena is switched off in this mode.
+ */
+
+#define JOBS_WINDOW 4096
+#define JOBS_MAX_WORKERS 64
+
+typedef struct job_slot
+{
+  lval* x;
+  // The printed result, serialized by the worker.
+  writer text;
+  atomic_int done;
+} job_slot;
+
+typedef struct jobs
+{
+  job_slot slots[JOBS_WINDOW];
+
+  // Forms read so far and forms handed to a worker, slot i % JOBS_WINDOW.
+  atomic_long published;
+  atomic_long claimed;
+
+  // Set once all forms have been read.
+  atomic_int finished;
+  int print;
+} jobs;
+
+void* jobs_worker(void* arg)
+{
+  jobs* j = arg;
+  while (1)
   {
-    x = lval_qexpr();
+    /* Check finished first, a form published before it is still seen */
+    int finished = atomic_load(&j->finished);
+    long i = atomic_load(&j->claimed);
+    if (i < atomic_load(&j->published))
+    {
+      if (atomic_compare_exchange_weak(&j->claimed, &i, i + 1))
+      {
+        job_slot* s = &j->slots[i % JOBS_WINDOW];
+        uint64_t t = stats_start();
+        s->x = lispy_eval(s->x);
+        stats_phase(STAT_EVAL, t);
+        if (j->print)
+        {
+          t = stats_start();
+          lval_write(&s->text, s->x);
+          writer_putc(&s->text, '\n');
+          stats_phase(STAT_PRINT, t);
+        }
+        t = stats_start();
+        lval_del(s->x);
+        stats_phase(STAT_DEL, t);
+        atomic_store_explicit(&s->done, 1, memory_order_release);
+      }
+      continue;
+    }
+    if (finished)
+    {
+      break;
+    }
+    sched_yield();
   }
-  
-  /* Fill this list with any valid expression contained within */
-  for (int i = 0; i < t->children_num; i++) 
+  pool_drain();
+  free(eval_frames.frames);
+  free(walk.frames);
+  free(out.data);
+  free(gather_buf);
+  return NULL;
+}
+
+/* Evaluates every form r has left on n workers, printing the results in
+ * order when print is set, and returns how many forms there were. A read
+ * error stops it like it stops the sequential loop, in r->error. Returns
+ * -1 without reading anything when not a single worker could be started.
+ */
+
+long jobs_run(reader* r, int n, int print)
+{
+  n = n < 1 ? 1 : (n > JOBS_MAX_WORKERS ? JOBS_MAX_WORKERS : n);
+  jobs* j = calloc(1, sizeof(jobs));
+  j->print = print;
+  pthread_t threads[JOBS_MAX_WORKERS];
+  int started = 0;
+  while (started < n)
+  {
+    if (pthread_create(&threads[started], NULL, jobs_worker, j) != 0)
+    {
+      fprintf(stderr, "lispy: could only start %d of %d --jobs workers\n",
+        started, n);
+      break;
+    }
+    started++;
+  }
+  if (started == 0)
+  {
+    free(j);
+    return -1;
+  }
+
+  long published = 0;
+  long printed = 0;
+  int eof = 0;
+  while (!eof || printed < published)
   {
-    if (strcmp(t->children[i]->contents, "(") == 0)
+    /* Top up the window, a batch at a time so printing keeps up */
+    for (int k = 0; k < 64 && !eof && published - printed < JOBS_WINDOW; k++)
+    {
+      uint64_t t = stats_start();
+      lval* x = reader_next(r);
+      if (x == NULL)
+      {
+        eof = 1;
+        break;
+      }
+      stats_phase(STAT_READ, t);
+      perf_line_end();
+      job_slot* s = &j->slots[published % JOBS_WINDOW];
+      s->x = x;
+      atomic_store_explicit(&s->done, 0, memory_order_relaxed);
+      atomic_store_explicit(&j->published, ++published, memory_order_release);
+    }
+
+    /* Drain the head of the reorder buffer */
+    int progress = 0;
+    while (printed < published)
+    {
+      job_slot* s = &j->slots[printed % JOBS_WINDOW];
+      if (!atomic_load_explicit(&s->done, memory_order_acquire))
+      {
+        break;
+      }
+      writer_flush(&s->text, stdout);
+      printed++;
+      progress = 1;
+    }
+
+    if (!progress && (eof || published - printed == JOBS_WINDOW))
     {
-      continue; 
+      sched_yield();
     }
-    if (strcmp(t->children[i]->contents, ")") == 0)
+  }
+
+  atomic_store(&j->finished, 1);
+  for (int i = 0; i < started; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  for (int i = 0; i < JOBS_WINDOW; i++)
+  {
+    free(j->slots[i].text.data);
+  }
+  free(j);
+  return printed;
+}
+
+#define BATCH_OUTPUT_BUFFER (1 << 20)
+
+/* Evaluates, prints and deletes one top level expression of a script */
+void batch_form(lval* x)
+{
+  uint64_t t = stats_start();
+  x = lispy_eval(x);
+  stats_phase(STAT_EVAL, t);
+  t = stats_start();
+  lval_println(x);
+  stats_phase(STAT_PRINT, t);
+  t = stats_start();
+  lval_del(x);
+  stats_phase(STAT_DEL, t);
+  perf_line_end();
+
+  if (arena_enabled)
+  {
+    arena_reset_all();
+  }
+}
+
+/* Runs the script in [src, src + size) through the mpc parser lispy and
+ * returns how many expressions it had. mpc wants a terminated string,
+ * which a mapped file isn't, so it gets a copy. Sets *status on a parse
+ * error.
+ */
+
+long batch_mpc(char* name, char* src, size_t size, mpc_parser_t* lispy,
+  int* status)
+{
+  char* text = malloc(size + 1);
+  memcpy(text, src, size);
+  text[size] = '\0';
+
+  mpc_result_t r;
+  uint64_t t = stats_start();
+  int parsed = mpc_parse(name, text, lispy, &r);
+  stats_phase(STAT_PARSE, t);
+  free(text);
+  if (!parsed)
+  {
+    fflush(stdout);
+    mpc_err_print_to(r.error, stderr);
+    mpc_err_delete(r.error);
+    *status = 1;
+    return 0;
+  }
+
+  /* The root holds the expressions between the /^/ and /$/ regexes */
+  mpc_ast_t* ast = r.output;
+  long count = 0;
+  for (int i = 0; i < ast->children_num; i++)
+  {
+    if (strcmp(ast->children[i]->tag, "regex") == 0)
     {
-      continue; 
+      continue;
     }
-    if (strcmp(t->children[i]->contents, "}") == 0) 
+    t = stats_start();
+    lval* x = lval_read(ast->children[i]);
+    stats_phase(STAT_READ, t);
+    batch_form(x);
+    count++;
+  }
+
+  t = stats_start();
+  mpc_ast_delete(ast);
+  stats_phase(STAT_AST_DELETE, t);
+  return count;
+}
+
+int batch_run(char* path, mpc_parser_t* lispy)
+{
+  size_t size;
+  char* src = batch_map(path, &size);
+  int mapped = src != NULL;
+  if (!mapped)
+  {
+    src = batch_slurp(path, &size);
+  }
+  if (src == NULL)
+  {
+    fprintf(stderr, "lispy: cannot read %s\n", path);
+    return 1;
+  }
+
+  setvbuf(stdout, NULL, _IOFBF, BATCH_OUTPUT_BUFFER);
+
+  char* name = strcmp(path, "-") == 0 ? "<stdin>" : path;
+  reader r = { .name = name, .start = src, .end = src + size, .pos = src };
+  long count = -1;
+  int status = 0;
+  double start = bench_now();
+
+  if (lispy != NULL)
+  {
+    if (jobs_workers > 1)
     {
-      continue; 
+      fprintf(stderr, "lispy: --jobs is ignored with --mpc\n");
     }
-    if (strcmp(t->children[i]->contents, "{") == 0)
+    count = batch_mpc(name, src, size, lispy, &status);
+  }
+  else if (jobs_workers > 1)
+  {
+    if (arena_enabled)
     {
-      continue; 
+      fprintf(stderr, "lispy: --arena is ignored with --jobs\n");
+      arena_enabled = 0;
     }
-    if (strcmp(t->children[i]->tag,  "regex") == 0)
+    count = jobs_run(&r, jobs_workers, 1);
+  }
+
+  /* Without workers the forms are run one after the other here */
+  if (count < 0)
+  {
+    count = 0;
+    lval* x;
+    uint64_t t = stats_start();
+    while ((x = reader_next(&r)) != NULL)
     {
-      continue; 
+      stats_phase(STAT_READ, t);
+      batch_form(x);
+      count++;
+      t = stats_start();
     }
-    x = lval_add(x, lval_read(t->children[i]));
   }
-  
-  return x;
+
+  if (r.error[0] != '\0')
+  {
+    fflush(stdout);
+    fprintf(stderr, "%s\n", r.error);
+    status = 1;
+  }
+
+  double total = bench_now() - start;
+  fflush(stdout);
+  fprintf(stderr, "batch: %ld expressions in %.3f s, %.0f expressions/s\n",
+    count, total, total > 0 ? count / total : 0.0);
+  if (use_fold)
+  {
+    fprintf(stderr, "fold: %ld nodes eliminated\n",
+      atomic_load(&fold_eliminated));
+  }
+
+  free(r.stack);
+#ifndef _WIN32
+  if (mapped)
+  {
+    munmap(src, size);
+  }
+  else
+#endif
+  {
+    free(src);
+  }
+  return status;
 }
 
 int main(int argc, char** argv) 
 {
+  intern_builtins();
+  simd_init(0);
+
+  /* Script to run in batch mode, "-" is stdin */
+  char* script = NULL;
   
   mpc_parser_t* Number = mpc_new("number");
+  mpc_parser_t* Integer = mpc_new("integer");
   mpc_parser_t* Symbol = mpc_new("symbol");
   mpc_parser_t* Sexpr  = mpc_new("sexpr");
   mpc_parser_t* Qexpr  = mpc_new("qexpr");
@@ -538,15 +6817,130 @@ int main(int argc, char** argv)
   
   mpca_lang(MPCA_LANG_DEFAULT,
     "                                          	             \
-      number : /-?[0-9]+.[0-9]+/ ;                  	     \
+      number : /-?[0-9]+\\.[0-9]+([eE][-+]?[0-9]+)?/ ;     \
+      integer: /-?[0-9]+/ ;                                  \
       symbol : '+' | '-' | '*' | '/' | '%' | '^';            \
       sexpr  : '(' <expr>* ')' ;                    	     \
       qexpr  : '{' <expr>* '}' ;		    	     \
-      expr   : <number> | <symbol> | <sexpr> | <qexpr>;      \
+      expr   : <number> | <integer> | <symbol> | <sexpr>      \
+             | <qexpr> ;                                     \
       lispy  : /^/ <expr>* /$/ ;                    	     \
     ",
-    Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    Number, Integer, Symbol, Sexpr, Qexpr, Expr, Lispy);
   
+  /* Command line flags */
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--arena") == 0)
+    {
+      arena_enabled = 1;
+    }
+    if (strcmp(argv[i], "--mpc") == 0)
+    {
+      use_mpc = 1;
+    }
+    if (strcmp(argv[i], "--vm") == 0)
+    {
+      use_vm = 1;
+    }
+    if (strcmp(argv[i], "--vm-check") == 0)
+    {
+      use_vm = 1;
+      vm_check = 1;
+    }
+    if (strcmp(argv[i], "--fold") == 0)
+    {
+      use_fold = 1;
+    }
+    if (strcmp(argv[i], "--stats") == 0)
+    {
+      stats_enable();
+    }
+    if (strcmp(argv[i], "--perf") == 0 && i + 1 < argc)
+    {
+      perf_open(argv[++i]);
+    }
+    if (strcmp(argv[i], "--pool-stats") == 0)
+    {
+      pool_stats_enabled = 1;
+    }
+    if (strcmp(argv[i], "--no-simd") == 0)
+    {
+      simd_init(1);
+    }
+    if (strcmp(argv[i], "--parallel") == 0 && i + 1 < argc)
+    {
+      par_init(atoi(argv[++i]));
+    }
+    if (strcmp(argv[i], "--par-threshold") == 0 && i + 1 < argc)
+    {
+      par_threshold = atoi(argv[++i]);
+    }
+    if (strcmp(argv[i], "--eval-budget") == 0 && i + 1 < argc)
+    {
+      eval_budget = (size_t)atol(argv[++i]) << 20;
+    }
+    if (strcmp(argv[i], "--legacy-float") == 0)
+    {
+      legacy_float = 1;
+    }
+    if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+    {
+      jobs_workers = atoi(argv[++i]);
+    }
+    if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+    {
+      script = argv[++i];
+    }
+    if (strcmp(argv[i], "--bench-suite") == 0)
+    {
+      bench_suite_enabled = 1;
+    }
+    if (strcmp(argv[i], "--bench-reps") == 0 && i + 1 < argc)
+    {
+      suite_reps = atoi(argv[++i]);
+    }
+    if (strcmp(argv[i], "--bench-warmup") == 0 && i + 1 < argc)
+    {
+      suite_warmup = atoi(argv[++i]);
+    }
+    if (strcmp(argv[i], "--bench-size") == 0 && i + 1 < argc)
+    {
+      suite_size = atoi(argv[++i]);
+    }
+    if (strcmp(argv[i], "--bench-format") == 0 && i + 1 < argc)
+    {
+      suite_json = strcmp(argv[++i], "json") == 0;
+    }
+    if (strcmp(argv[i], "--bench") == 0)
+    {
+      bench_run();
+      return 0;
+    }
+  }
+
+  /* Runs after the loop so the suite flags can come in any order */
+  if (bench_suite_enabled)
+  {
+    bench_suite();
+    return 0;
+  }
+
+#ifndef _WIN32
+  /* Input that isn't a terminal is a script piped in */
+  if (script == NULL && !isatty(STDIN_FILENO))
+  {
+    script = "-";
+  }
+#endif
+
+  if (script != NULL)
+  {
+    int status = batch_run(script, use_mpc ? Lispy : NULL);
+    mpc_cleanup(7, Number, Integer, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    return status;
+  }
+
   puts("Lispy Version 0.0.0.0.5");
   puts("Press Ctrl+c to Exit\n");
   
@@ -554,32 +6948,99 @@ int main(int argc, char** argv)
   {
   
     char* input = readline("lispy> ");
+    if (input == NULL)
+    {
+      break;
+    }
     add_history(input);
+
+    /* REPL commands */
+    if (strncmp(input, ":stats", 6) == 0)
+    {
+      stats_command(input + 6);
+      free(input);
+      continue;
+    }
     
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) 
+    lval* x = NULL;
+    mpc_ast_t* ast = NULL;
+    if (use_mpc)
+    {
+      mpc_result_t r;
+      uint64_t t = stats_start();
+      int parsed = mpc_parse("<stdin>", input, Lispy, &r);
+      stats_phase(STAT_PARSE, t);
+      if (parsed) 
+      {
+        // We pass the ast to lval_read() which returns an lval* 
+        // which is passed to lval_eval().
+        ast = r.output;
+        t = stats_start();
+        x = lval_read(ast);
+        stats_phase(STAT_READ, t);
+      }
+      else 
+      {    
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+      }
+    }
+    else
     {
-      // We pass the ast to lval_read() which returns an lval* 
-      // which is passed to lval_eval().
+      char error[256];
+      uint64_t t = stats_start();
+      x = lval_read_str("<stdin>", input, strlen(input), error, sizeof(error));
+      stats_phase(STAT_READ, t);
+      if (x == NULL)
+      {
+        puts(error);
+      }
+    }
 
-      lval* x = (lval_read(r.output));
+    if (x != NULL)
+    {
+      long folded = atomic_load(&fold_eliminated);
+      uint64_t t = stats_start();
+      x = lispy_eval(x);
+      stats_phase(STAT_EVAL, t);
+      if (use_fold)
+      {
+        printf("fold: %ld nodes eliminated\n",
+          atomic_load(&fold_eliminated) - folded);
+      }
+      t = stats_start();
       lval_println(x);
+      stats_phase(STAT_PRINT, t);
+      t = stats_start();
       lval_del(x);
-      
-      mpc_ast_print(r.output);
-      mpc_ast_delete(r.output);
+      stats_phase(STAT_DEL, t);
+    }
+
+    /* Release everything this line allocated in one go */
+    if (arena_enabled)
+    {
+      printf("arena: %zu bytes\n", arena_bytes_all());
+      arena_reset_all();
     }
-    else 
-    {    
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
+    if (pool_stats_enabled)
+    {
+      printf("pool: %zu hits, %zu misses\n", pool.hits, pool.misses);
+    }
+
+    if (ast != NULL)
+    {
+      mpc_ast_print(ast);
+      uint64_t t = stats_start();
+      mpc_ast_delete(ast);
+      stats_phase(STAT_AST_DELETE, t);
     }
+    perf_line_end();
     
     free(input);
     
   }
   
-  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  mpc_cleanup(7, Number, Integer, Symbol, Sexpr, Qexpr, Expr, Lispy);
   
   return 0;
 }
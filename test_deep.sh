@@ -0,0 +1,84 @@
+#!/bin/sh
+# Evaluates expressions nested 300000 deep in every evaluation mode, none
+# of which may recurse on the C stack per level of nesting. --mpc is left
+# out: mpc's own parser recurses per level, so only the built-in reader is
+# covered here.
+#
+#   cc -std=c99 q_expressions.c mpc.c -ledit -lm -lpthread -o q_expressions
+#   ./test_deep.sh ./q_expressions
+
+lispy=${1:-./q_expressions}
+depth=${2:-300000}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# Prints $1 opened depth times, then $2, then depth closing brackets $3,
+# parentheses by default
+nest()
+{
+  awk -v d="$depth" -v open="$1" -v mid="$2" -v shut="${3:-)}" 'BEGIN {
+    for (i = 0; i < d; i++) printf "%s", open
+    printf "%s", mid
+    for (i = 0; i < d; i++) printf "%s", shut
+    printf "\n"
+  }'
+}
+
+# Prints numbers as %g so the check doesn't depend on how they are printed
+normalize()
+{
+  awk '/^-?[0-9.]+$/ { printf "%g\n", $0; next } { print }'
+}
+
+{
+  nest "(+ 1.0 " "1.0"
+  nest "(* 1.0 " "2.5"
+  nest "(" "- 7.0 2.0"
+  nest "(+ 1.0 " "{1.0 2.0}"
+  nest "(- 1.0 " "(/ 1.0 0.0)"
+  nest "{" "1.0" "}"
+} > "$dir/deep.lspy"
+
+cat > "$dir/expected" <<EOF
+$((depth + 1))
+2.5
+5
+Error: Cannot operator on non number!
+Error: Division By Zero.
+EOF
+nest "{" "1.0" "}" >> "$dir/expected"
+
+status=0
+for mode in "" "--arena" "--vm" "--vm-check" "--fold" "--fold --vm" \
+  "--parallel 2" "--jobs 2"
+do
+  if ! $lispy $mode -f "$dir/deep.lspy" > "$dir/out" 2> /dev/null \
+    || ! normalize < "$dir/out" | cmp -s - "$dir/expected"
+  then
+    echo "FAIL: ${mode:-default}"
+    status=1
+  else
+    echo "ok: ${mode:-default}"
+  fi
+done
+
+# A 1 MiB --eval-budget holds 65536 frames, too few for the first line,
+# and every mode has to turn it down the same way
+head -n 1 "$dir/deep.lspy" > "$dir/budget.lspy"
+echo "Error: Nesting exceeds the evaluation budget." > "$dir/expected"
+for mode in "" "--vm" "--vm-check" "--fold" "--fold --vm"
+do
+  if [ "$depth" -le 65536 ]
+  then
+    break
+  fi
+  if ! $lispy $mode --eval-budget 1 -f "$dir/budget.lspy" > "$dir/out" \
+    2> /dev/null || ! cmp -s "$dir/out" "$dir/expected"
+  then
+    echo "FAIL: budget ${mode:-default}"
+    status=1
+  else
+    echo "ok: budget ${mode:-default}"
+  fi
+done
+exit $status
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Checks that printed numbers read back as themselves, subnormals and
+# numbers printed with an exponent included.
+#
+#   cc -std=c99 q_expressions.c mpc.c -ledit -lm -lpthread -o q_expressions
+#   ./test_print.sh ./q_expressions
+
+lispy=${1:-./q_expressions}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/print.lspy" <<EOF
+0.1
+(/ 1.0 3.0)
+5.0e-324
+(* 2.0 5.0e-324)
+-2.5e-310
+2.2250738585072014e-308
+1.7976931348623157e308
+{1.0e-320 0.5 123456789.0}
+EOF
+
+cat > "$dir/expected" <<EOF
+0.1
+0.3333333333333333
+5.0e-324
+1.0e-323
+-2.5e-310
+2.2250738585072014e-308
+1.7976931348623157e308
+{1.0e-320 0.5 123456789.0}
+EOF
+
+status=0
+if ! $lispy -f "$dir/print.lspy" > "$dir/out" 2> /dev/null \
+  || ! cmp -s "$dir/out" "$dir/expected"
+then
+  echo "FAIL: print"
+  status=1
+else
+  echo "ok: print"
+fi
+
+# What was printed has to read back to the same output
+if ! $lispy -f "$dir/out" > "$dir/again" 2> /dev/null \
+  || ! cmp -s "$dir/again" "$dir/out"
+then
+  echo "FAIL: read back"
+  status=1
+else
+  echo "ok: read back"
+fi
+exit $status
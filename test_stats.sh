@@ -0,0 +1,36 @@
+#!/bin/sh
+# Checks that --stats counts every node freed exactly once, with and
+# without arenas, including Integers and Bignums promoted to Numbers in
+# place.
+#
+#   cc -std=c99 q_expressions.c mpc.c -ledit -lm -lpthread -o q_expressions
+#   ./test_stats.sh ./q_expressions
+
+lispy=${1:-./q_expressions}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/stats.lspy" <<EOF
+(+ 1 1.5)
+(* 100000000000000000000 1.5)
+(- 2 (* 1 1.0))
+(+ {1 2} {3 4})
+(/ 1 0.0)
+EOF
+
+status=0
+for mode in "" "--arena" "--arena --vm" "--arena --vm-check" "--arena --fold" \
+  "--arena --parallel 2" "--jobs 2"
+do
+  # Fails when the type table is missing or a live count isn't zero
+  if ! $lispy $mode --stats -f "$dir/stats.lspy" > /dev/null 2> "$dir/err" \
+    || ! grep -q "^int " "$dir/err" \
+    || awk '$1 == "type" { t = 1; next } t && $4 != 0' "$dir/err" | grep -q .
+  then
+    echo "FAIL: ${mode:-default}"
+    status=1
+  else
+    echo "ok: ${mode:-default}"
+  fi
+done
+exit $status
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Applies the arithmetic operators element by element to Q-expressions of
+# numbers in every evaluation mode, packed or not. Integers and Bignums in
+# a list keep the same exact arithmetic they have outside one.
+#
+#   cc -std=c99 q_expressions.c mpc.c -ledit -lm -lpthread -o q_expressions
+#   ./test_vec.sh ./q_expressions
+
+lispy=${1:-./q_expressions}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/vec.lspy" <<EOF
+(+ {1.0 2.0} {3.0 4.0})
+(+ {1 2} {3 4})
+(* {1 2.5} {2 2} {3 1})
+(- {1 2})
+(+ {1.0 2.0} {1 2})
+(+ {9007199254740993} {0})
+(/ {7} {2})
+(* {9223372036854775807 2} {2 2})
+(+ {1 2} {3})
+(/ {1 2} {0 1})
+(% {7} {0})
+(+ {1 {2}} {3 4})
+(+ 1 {1 2})
+{1 2 3}
+EOF
+
+cat > "$dir/expected" <<EOF
+{4.0 6.0}
+{4 6}
+{6 5.0}
+{-1 -2}
+{2.0 4.0}
+{9007199254740993}
+{3}
+{18446744073709551614 4}
+Error: Vector length mismatch.
+Error: Division By Zero.
+Error: Modulo By Zero.
+Error: Cannot operator on non number!
+Error: Cannot operator on non number!
+{1 2 3}
+EOF
+
+status=0
+for mode in "" "--arena" "--vm" "--vm-check" "--arena --vm-check" "--fold"
+do
+  if ! $lispy $mode -f "$dir/vec.lspy" > "$dir/out" 2> /dev/null \
+    || ! cmp -s "$dir/out" "$dir/expected"
+  then
+    echo "FAIL: ${mode:-default}"
+    status=1
+  else
+    echo "ok: ${mode:-default}"
+  fi
+done
+exit $status